@@ -0,0 +1,5 @@
+(define ack (lambda (m n)
+  (if m
+      (if n (ack (- m 1) (ack m (- n 1))) (ack (- m 1) 1))
+      (+ n 1))))
+(ack 2 500)
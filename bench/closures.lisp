@@ -0,0 +1,3 @@
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+(define count (lambda (i acc) (if i (count (- i 1) ((make-adder 1) acc)) acc)))
+(count 200000 0)
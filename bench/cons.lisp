@@ -0,0 +1,4 @@
+(define range (lambda (n acc) (if n (range (- n 1) (cons n acc)) acc)))
+(define l (range 100000 ()))
+(length (filter (lambda (x) (< x 50000)) (map (lambda (x) (* x 2)) l)))
+(reduce + 0 l)
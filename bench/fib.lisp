@@ -0,0 +1,2 @@
+(define fib (lambda (n) (if (- n 1) (if (- n 2) (+ (fib (- n 1)) (fib (- n 2))) 1) 1)))
+(fib 24)
@@ -0,0 +1,25 @@
+#!/usr/bin/env python3
+"""Writes the tokenize/parse workload: many defines of nested arithmetic.
+
+The output depends only on the arguments, so runs are comparable.
+Usage: gen_parse.py FORMS DEPTH > parse.lisp
+"""
+import sys
+
+
+def expression(seed, depth):
+    if depth == 0:
+        return str(seed % 97)
+    op = "+" if seed % 2 else "-"
+    return "(%s %s %s %d)" % (op, expression(seed * 7 + 1, depth - 1), expression(seed * 3 + 2, depth - 1), seed % 10)
+
+
+def main():
+    forms = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+    depth = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+    for i in range(forms):
+        print("(define v%d %s)" % (i, expression(i, depth)))
+
+
+if __name__ == "__main__":
+    main()
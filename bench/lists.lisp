@@ -0,0 +1,4 @@
+(define kons (lambda (a b) (lambda (f) (f a b))))
+(define build (lambda (n acc) (if n (build (- n 1) (kons n acc)) acc)))
+(define sum (lambda (l n acc) (if n (l (lambda (a b) (sum b (- n 1) (+ acc a)))) acc)))
+(sum (build 100000 0) 100000 0)
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Builds both programs with optimizations and runs every workload, printing
+# ns/op, allocs/op and peak RSS for each. Output goes to stdout, one line
+# per workload, so runs can be diffed.
+#
+# Lisp workloads (the interpreter has no comment syntax, so they are
+# described here):
+#   fib        doubly recursive Fibonacci: non-tail calls and arithmetic
+#   tak        Takeuchi function: deep non-tail recursion on three arguments
+#   ackermann  half a million calls, nested up to 1000 deep
+#   closures   each step makes and calls a fresh closure
+#   lists      builds a 100000 cell list of closure-encoded pairs, then
+#              sums it by tail calls
+#   cons       the same list of native pairs, then map, filter, length and
+#              reduce over it
+#   memo       tak on larger arguments, memoized with define-memo: a fresh
+#              table each run, three-number keys
+#   vectors    element-wise arithmetic, dot and sum over 1e6 element vectors
+#   parse      20000 generated defines of nested arithmetic (gen_parse.py)
+#
+# Usage: bench/run.sh [runs per Lisp workload]
+set -e
+
+runs=${1:-10}
+here=$(cd "$(dirname "$0")" && pwd)
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+CXX=${CXX:-g++}
+$CXX -std=c++17 -O2 -pthread -o "$out/lisp_interpreter" "$here/../lisp.cpp"
+$CXX -std=c++17 -O2 -pthread -o "$out/unify_bench" "$here/unify_bench.cpp"
+cp "$here"/*.lisp "$out"
+python3 "$here/gen_parse.py" 20000 4 > "$out/parse.lisp"
+
+cd "$out"
+for engine in vm tree; do
+    echo "# lisp --engine=$engine"
+    for workload in fib tak ackermann closures lists cons memo vectors parse; do
+        ./lisp_interpreter --engine=$engine --bench="$runs" $workload.lisp
+    done
+done
+
+echo "# unifier"
+./unify_bench
@@ -0,0 +1,237 @@
+// Unifier workloads: large and deep generated types, constraint batches
+// and resolution queries. Each is run a fixed number of times over the
+// same inputs, undoing its bindings between runs, and reported as ns/op,
+// allocs/op and the peak RSS of the process so far.
+//
+// g++ -std=c++17 -O2 -pthread -o unify_bench unify_bench.cpp
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "../resolution.h"
+#include "../unification.h"
+
+// Counted across threads, since the parallel solver allocates on workers
+std::atomic<size_t> allocationCount{0};
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+size_t peakRssKb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return static_cast<size_t>(usage.ru_maxrss) / 1024;
+#else
+    return static_cast<size_t>(usage.ru_maxrss);
+#endif
+}
+
+template <typename Body>
+void bench(const char* name, size_t ops, Body body) {
+    body(); // warm up, untimed
+    size_t allocationsBefore = allocationCount.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        body();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << ops << " ops, " << static_cast<uint64_t>(elapsed.count() / ops) << " ns/op, "
+              << (allocationCount.load() - allocationsBefore) / ops << " allocs/op, " << peakRssKb()
+              << " KB peak RSS\n";
+}
+
+std::shared_ptr<Type> variable() {
+    return types().fresh();
+}
+
+// v0 -> v1 -> ... -> result, with a fresh variable at each level
+std::shared_ptr<Type> arrowChain(size_t depth, const std::shared_ptr<Type>& result, std::vector<std::shared_ptr<Type>>* vars) {
+    std::shared_ptr<Type> type = result;
+    for (size_t i = 0; i < depth; ++i) {
+        auto var = variable();
+        if (vars) {
+            vars->push_back(var);
+        }
+        type = types().function(var, type);
+    }
+    return type;
+}
+
+// Unifies the two types under a trail, then undoes every binding made
+bool unifyAndUndo(const std::shared_ptr<Type>& left, const std::shared_ptr<Type>& right, OccursCheck check) {
+    Trail trail;
+    UnifyState state{check, {}, {}, {}, {}, &trail};
+    bool unified = unifyCells(left, right, state);
+    trail.undoTo(0);
+    return unified;
+}
+
+void reset(const std::vector<std::shared_ptr<Type>>& vars) {
+    for (const auto& var : vars) {
+        static_cast<TypeVariable&>(*var).binding.reset();
+        static_cast<TypeVariable&>(*var).rank = 0;
+    }
+}
+
+int main() {
+    auto intType = types().constant("Int");
+
+    // A 10000 deep arrow of variables against one of Int
+    {
+        auto left = arrowChain(10000, intType, nullptr);
+        auto right = arrowChain(0, intType, nullptr);
+        for (size_t i = 0; i < 10000; ++i) {
+            right = types().function(intType, right);
+        }
+        bench("unify/deep-arrow-10000", 200, [&] { unifyAndUndo(left, right, OccursCheck::Eager); });
+    }
+
+    // Two 1000 argument compounds, variables against constants
+    {
+        std::vector<std::shared_ptr<Type>> vars, constants;
+        for (size_t i = 0; i < 1000; ++i) {
+            vars.push_back(variable());
+            constants.push_back(types().constant("c" + std::to_string(i)));
+        }
+        auto left = types().compound("f", vars);
+        auto right = types().compound("f", constants);
+        bench("unify/wide-compound-1000", 2000, [&] { unifyAndUndo(left, right, OccursCheck::Eager); });
+    }
+
+    // Chains of variable-variable bindings, then the whole class bound to
+    // a 1000 deep type holding a variable, which the occurs check walks
+    {
+        std::vector<std::shared_ptr<Type>> vars;
+        for (size_t i = 0; i < 1000; ++i) {
+            vars.push_back(variable());
+        }
+        auto deep = arrowChain(1000, variable(), nullptr);
+        std::vector<std::shared_ptr<Type>> left, right;
+        for (size_t i = 0; i + 1 < vars.size(); ++i) {
+            left.push_back(vars[i]);
+            right.push_back(vars[i + 1]);
+        }
+        left.push_back(vars.back());
+        right.push_back(deep);
+        auto lhs = types().compound("eqs", left);
+        auto rhs = types().compound("eqs", right);
+        bench("unify/var-chain-occurs-1000", 500, [&] { unifyAndUndo(lhs, rhs, OccursCheck::Eager); });
+        bench("unify/var-chain-deferred-1000", 500, [&] { unifyAndUndo(lhs, rhs, OccursCheck::Deferred); });
+    }
+
+    // A batch of 10000 constraints: a chain of arrows to be linked
+    // together, a tenth of them contradicting the rest
+    std::vector<std::shared_ptr<Type>> batchVars;
+    std::vector<Constraint> batch;
+    {
+        auto boolType = types().constant("Bool");
+        std::vector<std::shared_ptr<Type>> vars;
+        for (size_t i = 0; i <= 10000; ++i) {
+            vars.push_back(variable());
+        }
+        for (size_t i = 0; i < 10000; ++i) {
+            auto result = i % 10 == 9 ? boolType : intType;
+            batch.push_back({types().function(vars[i], intType), types().function(vars[i + 1], result)});
+        }
+        batch.push_back({vars[0], intType});
+        batchVars = vars;
+        bench("solve/batch-10000", 100, [&] {
+            solve(batch);
+            reset(batchVars);
+        });
+    }
+
+    // 64 independent groups of 1000 constraints on a pool
+    {
+        std::vector<std::shared_ptr<Type>> vars;
+        std::vector<Constraint> groups;
+        for (size_t g = 0; g < 64; ++g) {
+            std::shared_ptr<Type> previous = variable();
+            vars.push_back(previous);
+            for (size_t i = 0; i < 1000; ++i) {
+                auto next = variable();
+                vars.push_back(next);
+                groups.push_back({types().function(previous, intType), types().function(next, intType)});
+                previous = next;
+            }
+        }
+        ThreadPool pool;
+        bench("solve/sequential-64x1000", 20, [&] {
+            solve(groups);
+            reset(vars);
+        });
+        bench("solve/parallel-64x1000", 20, [&] {
+            solveParallel(groups, pool);
+            reset(vars);
+        });
+    }
+
+    auto term = [](const std::string& name, std::vector<std::shared_ptr<Type>> args) {
+        return types().compound(name, std::move(args));
+    };
+
+    // Deterministic recursion: nat(s(s(...(z)))) 10000 deep
+    {
+        ClauseDatabase db;
+        auto x = types().variable("X");
+        db.add(term("nat", {types().constant("z")}));
+        db.add(term("nat", {term("s", {x})}), {term("nat", {x})});
+        std::shared_ptr<Type> number = types().constant("z");
+        for (size_t i = 0; i < 10000; ++i) {
+            number = term("s", {number});
+        }
+        auto goal = term("nat", {number});
+        bench("resolve/nat-10000", 100, [&] { db.query({goal}, [] { return true; }); });
+    }
+
+    // Every answer of ancestor(n0, Who) over a 100 long chain of parents
+    {
+        ClauseDatabase db;
+        for (size_t i = 0; i < 100; ++i) {
+            db.add(term("parent", {types().constant("n" + std::to_string(i)),
+                                   types().constant("n" + std::to_string(i + 1))}));
+        }
+        auto x = types().variable("X");
+        auto y = types().variable("Y");
+        auto z = types().variable("Z");
+        db.add(term("ancestor", {x, y}), {term("parent", {x, y})});
+        db.add(term("ancestor", {x, y}), {term("parent", {x, z}), term("ancestor", {z, y})});
+        auto goal = term("ancestor", {types().constant("n0"), types().variable("Who")});
+        bench("resolve/ancestor-100", 100, [&] { db.query({goal}, [] { return true; }); });
+    }
+
+    return 0;
+}
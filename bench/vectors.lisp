@@ -0,0 +1,4 @@
+(define v (vec-range 1000000))
+(define w (vec-add (vec-mul v 0.5) 1))
+(dot v w)
+(sum (vec-mul (vec-add v w) v))
@@ -3,329 +3,4626 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
-#include <variant>
+#include <algorithm>
+#include <type_traits>
 #include <functional>
 #include <cctype>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <stdexcept>
+#include <cstdlib>
+#include <new>
+#include <chrono>
+#include <string_view>
+#include <charconv>
+#include <fstream>
+#include <array>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LISP_HAVE_MMAP 1
+#define LISP_HAVE_RUSAGE 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define LISP_HAVE_MMAP 0
+#define LISP_HAVE_RUSAGE 0
+#endif
+
+// Vector kernels use the widest of these the target enables; elsewhere,
+// or with -DLISP_NO_SIMD, they are plain loops
+#if defined(LISP_NO_SIMD) || !defined(__GNUC__)
+#elif defined(__AVX2__)
+#define LISP_SIMD_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define LISP_SIMD_SSE2 1
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#define LISP_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "lisp.h"
+#include "stats.h"
+#include "unification.h"
+
+// Allocation accounting
+// Every heap allocation made by a thread is counted so the cost of a form
+// can be measured; the REPL reports it per form with --alloc-stats.
+// The replacements are kept out of line so GCC does not see malloc and free
+// through them and report mismatched new/delete pairs. A host program that
+// embeds the interpreter (see lisp.h) builds with -DLISP_NO_MAIN and keeps
+// its own allocator; nothing is counted then.
+thread_local size_t allocationCount = 0;
+
+#ifndef LISP_NO_MAIN
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* operator new(size_t size) {
+    ++allocationCount;
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+#endif
 
 // Tokenization
+// The lexer is pulled one token at a time by the parser. Number and symbol
+// tokens are views into the source text, which must outlive them; parens
+// carry no text.
 enum class TokenType {
     PAREN_OPEN,
     PAREN_CLOSE,
     NUMBER,
     SYMBOL,
+    END,
 };
 
 struct Token {
     TokenType type;
-    std::string value;
+    std::string_view text;
 };
 
-std::vector<Token> tokenize(const std::string& code) {
-    std::vector<Token> tokens;
-    size_t i = 0;
+class Lexer {
+public:
+    explicit Lexer(std::string_view source) : source(source) {}
+
+    const Token& peek() {
+        if (!peeked) {
+            lookahead = scan();
+            peeked = true;
+        }
+        return lookahead;
+    }
+
+    Token next() {
+        peek();
+        LISP_STAT(ParseTokens);
+        peeked = false;
+        return lookahead;
+    }
+
+    // Offset of the next token in the source
+    size_t offset() {
+        peek();
+        return tokenStart;
+    }
+
+private:
+    std::string_view source;
+    size_t pos = 0;
+    size_t tokenStart = 0;
+    Token lookahead{TokenType::END, {}};
+    bool peeked = false;
+
+    static bool isSymbolChar(char c) {
+        return c != '\0' && strchr("+-*/%<>=!?", c);
+    }
 
-    while (i < code.length()) {
-        char c = code[i];
+    Token scan() {
+        while (pos < source.size() && isspace(static_cast<unsigned char>(source[pos]))) {
+            pos++;
+        }
+        tokenStart = pos;
+        if (pos == source.size()) {
+            return {TokenType::END, {}};
+        }
 
-        if (isspace(c)) {
-            i++;
-            continue;
-        } else if (c == '(') {
-            tokens.push_back({TokenType::PAREN_OPEN, "("});
-            i++;
+        char c = source[pos];
+        size_t start = pos;
+        if (c == '(') {
+            pos++;
+            return {TokenType::PAREN_OPEN, {}};
         } else if (c == ')') {
-            tokens.push_back({TokenType::PAREN_CLOSE, ")"});
-            i++;
-        } else if (isdigit(c) || (c == '-' && isdigit(code[i + 1]))) {
-            size_t start = i;
-            while (i < code.length() && (isdigit(code[i]) || code[i] == '.')) i++;
-            tokens.push_back({TokenType::NUMBER, code.substr(start, i - start)});
-        } else if (isalpha(c) || strchr("+-*/%<>=!", c)) {
-            size_t start = i;
-            while (i < code.length() && (isalnum(code[i]) || strchr("+-*/%<>=!", code[i]))) i++;
-            tokens.push_back({TokenType::SYMBOL, code.substr(start, i - start)});
+            pos++;
+            return {TokenType::PAREN_CLOSE, {}};
+        } else if (isdigit(c) || (c == '-' && pos + 1 < source.size() && isdigit(source[pos + 1]))) {
+            pos++;
+            while (pos < source.size() && (isdigit(source[pos]) || source[pos] == '.')) pos++;
+            return {TokenType::NUMBER, source.substr(start, pos - start)};
+        } else if (isalpha(c) || isSymbolChar(c)) {
+            while (pos < source.size() && (isalnum(source[pos]) || isSymbolChar(source[pos]))) pos++;
+            return {TokenType::SYMBOL, source.substr(start, pos - start)};
         } else {
             throw std::runtime_error(std::string("Unexpected character: ") + c);
         }
     }
+};
+
+// Symbols
+// Every symbol is interned once into a dense integer id so that environment
+// lookups and special-form checks compare and hash ids instead of strings.
+struct Symbol {
+    uint32_t id;
+
+    bool operator==(Symbol other) const { return id == other.id; }
+    bool operator!=(Symbol other) const { return id != other.id; }
+};
+
+struct SymbolHash {
+    size_t operator()(Symbol sym) const { return sym.id; }
+};
+
+// One table serves every interpreter instance, so it takes a lock: shared
+// for the lookups that find a symbol, exclusive to add one.
+class SymbolTable {
+public:
+    Symbol intern(std::string_view name) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = ids.find(name);
+            if (it != ids.end()) {
+                return it->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(name); // another thread may have added it meanwhile
+        if (it != ids.end()) {
+            return it->second;
+        }
+        Symbol sym{static_cast<uint32_t>(names.size())};
+        names.emplace_back(name);
+        ids.emplace(names.back(), sym);
+        return sym;
+    }
+
+    const std::string& name(Symbol sym) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return names[sym.id];
+    }
+
+private:
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string_view, Symbol> ids; // keys view into names
+    std::deque<std::string> names; // deque keeps name() references stable
+};
 
-    return tokens;
+SymbolTable& symbols() {
+    static SymbolTable table;
+    return table;
 }
 
+Symbol intern(std::string_view name) {
+    return symbols().intern(name);
+}
+
+// Special forms, interned up front so eval can compare ids
+const Symbol symDefine = intern("define");
+const Symbol symLambda = intern("lambda");
+const Symbol symIf = intern("if");
+const Symbol symDefineMemo = intern("define-memo");
+const Symbol symMemoize = intern("memoize");
+
+// Numeric builtins that type-checked calls may run without a lookup
+const Symbol symAdd = intern("+");
+const Symbol symSub = intern("-");
+const Symbol symMul = intern("*");
+const Symbol symLess = intern("<");
+const Symbol symDiv = intern("/");
+const Symbol symGreater = intern(">");
+const Symbol symEqual = intern("==");
+
 // Forward declaration
 struct Expression;
-using ExprPtr = std::shared_ptr<Expression>;
+using ExprPtr = Expression*;
 
-// Function object
-using BuiltinFunc = std::function<ExprPtr(const std::vector<ExprPtr>&)>;
+// Heap objects
+// Everything that is not a number lives in an Object owned by the garbage
+// collected Heap below. The header records which generation the object is
+// in and links it into that generation's list.
+enum class ObjectType : uint8_t {
+    Function,
+    Program,
+    Environment,
+    Vector,
+    Pair,
+    Memo,
+};
 
-// Environment
-struct Environment {
-    std::unordered_map<std::string, ExprPtr> vars; 
-    std::shared_ptr<Environment> outer;
+class Tracer;
 
-    Environment(std::shared_ptr<Environment> outer = nullptr) : outer(outer) {}
+struct Object {
+    ObjectType type;
+    bool marked = false;
+    bool old = false;        // survived a collection and was promoted
+    bool remembered = false; // old object recorded by the write barrier
+    uint32_t size = 0;       // bytes allocated, for heap accounting
+    Object* next = nullptr;
 
-    bool find(const std::string& var, ExprPtr& result) {
-        if (vars.find(var) != vars.end()) {
-            result = vars[var];
-            return true;
-        } else if (outer) {
-            return outer->find(var, result);
+    explicit Object(ObjectType type) : type(type) {}
+    virtual ~Object() = default;
+
+    // What the heap allocated for the object, which `size` may exceed once
+    // the object is charged for memory it owns
+    virtual size_t allocatedBytes() const { return size; }
+
+    // Marks every object this one references
+    virtual void trace(Tracer& tracer) = 0;
+};
+
+// Values
+// A Value is a single NaN-boxed 64-bit word. Numbers are stored as the
+// double itself, so arithmetic never allocates. Other values set all of the
+// quiet-NaN bits and carry a tag, or an object pointer, in the low 48 bits.
+// Real NaN results are canonicalized so they can't be mistaken for a box.
+// Objects are reclaimed by the collector, so copying a Value is free.
+class Value {
+public:
+    Value() : bits(undefinedBits) {}
+
+    static Value number(double num) {
+        Value value;
+        if (num != num) {
+            value.bits = canonicalNaN;
+        } else {
+            std::memcpy(&value.bits, &num, sizeof num);
         }
-        return false;
+        return value;
     }
 
-    void set(const std::string& var, ExprPtr value) {
-        vars[var] = value;
+    static Value nil() {
+        Value value;
+        value.bits = nilBits;
+        return value;
     }
-};
 
-struct Function {
-    std::vector<std::string> params;
-    ExprPtr body;
-    std::shared_ptr<Environment> env;
-    BuiltinFunc builtin;
+    static Value object(Object* obj) {
+        Value value;
+        value.bits = objectBits | reinterpret_cast<uintptr_t>(obj);
+        return value;
+    }
 
-    // Constructor for user-defined functions
-    Function(const std::vector<std::string>& params, ExprPtr body, std::shared_ptr<Environment> env)
-        : params(params), body(body), env(env) {}
+    bool isNumber() const { return (bits & quietNaN) != quietNaN; }
+    bool isNil() const { return bits == nilBits; }
+    // Unbound frame slots hold undefined; it is never the result of an expression
+    bool isUndefined() const { return bits == undefinedBits; }
+    bool isObject() const { return (bits & objectBits) == objectBits; }
+    bool isFunction() const { return isObject() && asObject()->type == ObjectType::Function; }
+    bool isVector() const { return isObject() && asObject()->type == ObjectType::Vector; }
+    bool isPair() const { return isObject() && asObject()->type == ObjectType::Pair; }
 
-    // Constructor for built-in functions
-    Function(BuiltinFunc builtin) : builtin(builtin) {}
+    double asNumber() const {
+        double num;
+        std::memcpy(&num, &bits, sizeof num);
+        return num;
+    }
+
+    Object* asObject() const {
+        return reinterpret_cast<Object*>(static_cast<uintptr_t>(bits & payloadMask));
+    }
 
-    // Default copy and move constructors and assignment operators
-    Function(const Function&) = default;
-    Function(Function&&) = default;
-    Function& operator=(const Function&) = default;
-    Function& operator=(Function&&) = default;
+    struct Function* asFunction() const;
+    struct Program* asProgram() const;
+    struct Environment* asEnvironment() const;
+    struct Vector* asVector() const;
+    struct Pair* asPair() const;
+
+    // Only non-zero numbers are true, as tested by if
+    bool isTruthy() const { return isNumber() && asNumber() != 0; }
+
+private:
+    static constexpr uint64_t quietNaN = 0x7ffc000000000000;
+    static constexpr uint64_t signBit = 0x8000000000000000;
+    static constexpr uint64_t objectBits = signBit | quietNaN;
+    static constexpr uint64_t payloadMask = 0x0000ffffffffffff;
+    static constexpr uint64_t nilBits = quietNaN | 1;
+    static constexpr uint64_t undefinedBits = quietNaN | 2;
+    static constexpr uint64_t canonicalNaN = 0x7ff8000000000000;
+
+    uint64_t bits;
 };
 
-// AST
-struct Expression {
-    std::variant<double, std::string, std::vector<ExprPtr>, std::shared_ptr<Function>> value;
+static_assert(sizeof(Value) == 8, "Value must stay a single word");
+static_assert(std::is_trivially_copyable<Value>::value, "Value is copied freely by the VM");
+
+// Arguments to a builtin: a borrowed view of the evaluated values, which
+// live on the evaluation stack for the duration of the call
+struct Args {
+    const Value* first;
+    size_t count;
 
-    Expression(double num) : value(num) {}
-    Expression(const std::string& sym) : value(sym) {}
-    Expression(const std::vector<ExprPtr>& list) : value(list) {}
-    Expression(std::shared_ptr<Function> func) : value(func) {}
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Value& operator[](size_t i) const { return first[i]; }
+    const Value* begin() const { return first; }
+    const Value* end() const { return first + count; }
 };
 
+// Function object
+using BuiltinFunc = std::function<Value(Args)>;
 
-// Parsing
-ExprPtr parseExpression(std::vector<Token>& tokens, size_t& pos);
-
-ExprPtr parseList(std::vector<Token>& tokens, size_t& pos) {
-    std::vector<ExprPtr> list;
-    pos++; // Skip '('
-    while (pos < tokens.size() && tokens[pos].type != TokenType::PAREN_CLOSE) {
-        list.push_back(parseExpression(tokens, pos));
-    }
-    if (pos == tokens.size() || tokens[pos].type != TokenType::PAREN_CLOSE) {
-        throw std::runtime_error("Missing closing parenthesis");
-    }
-    pos++; // Skip ')'
-    return std::make_shared<Expression>(list);
-}
-
-ExprPtr parseExpression(std::vector<Token>& tokens, size_t& pos) {
-    Token token = tokens[pos];
-    if (token.type == TokenType::NUMBER) {
-        pos++;
-        return std::make_shared<Expression>(std::stod(token.value));
-    } else if (token.type == TokenType::SYMBOL) {
-        pos++;
-        return std::make_shared<Expression>(token.value);
-    } else if (token.type == TokenType::PAREN_OPEN) {
-        return parseList(tokens, pos);
-    } else {
-        throw std::runtime_error("Unexpected token");
+// Garbage collection
+// A two-generation mark-and-sweep collector. New objects start in the
+// nursery; a minor collection marks only nursery objects, reachable from the
+// roots or from old objects recorded by the write barrier, frees the rest
+// and promotes the survivors. A major collection marks and sweeps both
+// generations, and runs once the old generation outgrows its threshold.
+//
+// Collections only happen inside Heap::make, so whatever the caller still
+// needs at that point must be reachable from a root: globals, the value
+// stack, VM frames, or a LocalRoot.
+class Tracer {
+public:
+    explicit Tracer(bool minor) : minor(minor) {}
+
+    void mark(Object* obj) {
+        if (!obj || obj->marked || (minor && obj->old)) {
+            return;
+        }
+        obj->marked = true;
+        gray.push_back(obj);
     }
-}
 
-ExprPtr parse(const std::string& code) {
-    auto tokens = tokenize(code);
-    size_t pos = 0;
-    return parseExpression(tokens, pos);
-}
+    void mark(const Value& value) {
+        if (value.isObject()) {
+            mark(value.asObject());
+        }
+    }
 
-// Evaluation
-bool isSymbol(ExprPtr expr) {
-    return std::holds_alternative<std::string>(expr->value);
-}
+    // Traces everything reachable from the marked objects, without recursion
+    void drain() {
+        while (!gray.empty()) {
+            Object* obj = gray.back();
+            gray.pop_back();
+            obj->trace(*this);
+        }
+    }
 
-bool isNumber(ExprPtr expr) {
-    return std::holds_alternative<double>(expr->value);
-}
+private:
+    bool minor;
+    std::vector<Object*> gray;
+};
 
-bool isList(ExprPtr expr) {
-    return std::holds_alternative<std::vector<ExprPtr>>(expr->value);
-}
+// Something outside the heap that holds references into it
+class RootSet {
+public:
+    virtual void traceRoots(Tracer& tracer) = 0;
 
-bool isFunction(ExprPtr expr) {
-    return std::holds_alternative<std::shared_ptr<Function>>(expr->value);
-}
+protected:
+    ~RootSet() = default;
+};
 
-ExprPtr eval(ExprPtr expr, std::shared_ptr<Environment> env) {
-    if (isSymbol(expr)) {
-        // Variable lookup
-        ExprPtr result;
-        if (env->find(std::get<std::string>(expr->value), result)) {
-            return result;
-        } else {
-            throw std::runtime_error("Undefined symbol: " + std::get<std::string>(expr->value));
+struct GcStats {
+    size_t minorCollections = 0;
+    size_t majorCollections = 0;
+    size_t bytesAllocated = 0;
+    size_t bytesFreed = 0;
+    size_t bytesPromoted = 0;
+    double totalPauseMs = 0;
+    double maxPauseMs = 0;
+};
+
+class Heap {
+public:
+    size_t nurserySize = 1 << 20;
+    size_t heapLimit = 0; // bytes; 0 means unlimited
+    GcStats stats;
+
+    Heap() = default;
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    ~Heap() {
+        freeList(young);
+        freeList(oldest);
+        for (void* slab : slabs) {
+            ::operator delete(slab);
         }
-    } else if (isNumber(expr)) {
-        // Numbers evaluate to themselves
-        return expr;
-    } else if (isList(expr)) {
-        auto list = std::get<std::vector<ExprPtr>>(expr->value);
-        if (list.empty()) {
-            return expr;
+    }
+
+    template <typename T, typename... Params>
+    T* make(Params&&... params) {
+        return makeWithExtra<T>(0, std::forward<Params>(params)...);
+    }
+
+    // Allocates `extra` bytes after the object for trailing data
+    template <typename T, typename... Params>
+    T* makeWithExtra(size_t extra, Params&&... params) {
+        size_t size = sizeof(T) + extra;
+        if (youngBytes + size > nurserySize && !frozen) {
+            collect(false);
+        }
+        void* memory = allocate(size);
+        T* obj;
+        try {
+            obj = new (memory) T(std::forward<Params>(params)...);
+        } catch (...) {
+            release(memory, size);
+            throw;
         }
+        Object* header = obj;
+        header->size = static_cast<uint32_t>(size);
+        header->next = young;
+        young = header;
+        youngBytes += size;
+        stats.bytesAllocated += size;
+        return obj;
+    }
 
-        // Get the first element to determine the operation
-        auto first = list[0];
+    // Must be called whenever a reference is stored into an existing object
+    void writeBarrier(Object* owner, const Value& value) {
+        if (owner->old && !owner->remembered && value.isObject() && !value.asObject()->old) {
+            owner->remembered = true;
+            remembered.push_back(owner);
+        }
+    }
 
-        if (isSymbol(first)) {
-            std::string sym = std::get<std::string>(first->value);
+    void addRoots(RootSet* roots) { rootSets.push_back(roots); }
 
-            if (sym == "define") {
-                // (define var expr)
-                if (list.size() != 3 || !isSymbol(list[1])) {
-                    throw std::runtime_error("Invalid define syntax");
-                }
-                std::string varName = std::get<std::string>(list[1]->value);
-                ExprPtr value = eval(list[2], env);
-                env->set(varName, value);
-                return value;
-            } else if (sym == "lambda") {
-                // (lambda (params) body)
-                if (list.size() != 3 || !isList(list[1])) {
-                    throw std::runtime_error("Invalid lambda syntax");
-                }
-                std::vector<std::string> params;
-                for (auto& param : std::get<std::vector<ExprPtr>>(list[1]->value)) {
-                    if (!isSymbol(param)) {
-                        throw std::runtime_error("Lambda parameters must be symbols");
-                    }
-                    params.push_back(std::get<std::string>(param->value));
-                }
-                ExprPtr body = list[2];
-                auto func = std::make_shared<Function>(params, body, env);
-                return std::make_shared<Expression>(func);
-            } else if (sym == "if") {
-                // (if cond then else)
-                if (list.size() != 4) {
-                    throw std::runtime_error("Invalid if syntax");
-                }
-                ExprPtr cond = eval(list[1], env);
-                if (isNumber(cond) && std::get<double>(cond->value) != 0) {
-                    return eval(list[2], env);
-                } else {
-                    return eval(list[3], env);
-                }
-            } else {
-                // Function application
-                ExprPtr funcExpr = eval(first, env);
-                if (!isFunction(funcExpr)) {
-                    throw std::runtime_error("First element is not a function");
-                }
-                auto func = std::get<std::shared_ptr<Function>>(funcExpr->value);
+    void removeRoots(RootSet* roots) {
+        rootSets.erase(std::remove(rootSets.begin(), rootSets.end(), roots), rootSets.end());
+    }
 
-                // Evaluate arguments
-                std::vector<ExprPtr> args;
-                for (size_t i = 1; i < list.size(); ++i) {
-                    args.push_back(eval(list[i], env));
-                }
+    void pushRoot(Value* root) { localRoots.push_back(root); }
+    void popRoot() { localRoots.pop_back(); }
 
-                if (func->builtin) {
-                    // Built-in function
-                    return func->builtin(args);
-                } else {
-                    // User-defined function
-                    if (args.size() != func->params.size()) {
-                        throw std::runtime_error("Incorrect number of arguments");
-                    }
-                    auto localEnv = std::make_shared<Environment>(func->env);
-                    for (size_t i = 0; i < func->params.size(); ++i) {
-                        localEnv->set(func->params[i], args[i]);
-                    }
-                    return eval(func->body, localEnv);
-                }
+    size_t liveBytes() const { return youngBytes + oldBytes; }
+
+    // Makes every object look marked and old, so the collector of any other
+    // heap that reaches one treats it as already traced and never writes to
+    // it, which lets other threads' heaps point into this one. A frozen
+    // heap still allocates but does not collect.
+    void freeze() {
+        frozen = true;
+        for (Object* list : {young, oldest}) {
+            for (Object* obj = list; obj; obj = obj->next) {
+                obj->marked = true;
+                obj->old = true;
             }
-        } else {
-            throw std::runtime_error("First element must be a symbol");
         }
     }
 
-    throw std::runtime_error("Invalid expression");
-}
+    // Undoes freeze. The young list holds exactly the objects that were
+    // young, along with any allocated while frozen.
+    void thaw() {
+        for (Object* obj = young; obj; obj = obj->next) {
+            obj->marked = false;
+            obj->old = false;
+        }
+        for (Object* obj = oldest; obj; obj = obj->next) {
+            obj->marked = false;
+        }
+        frozen = false;
+    }
 
-// Built-in Functions
-void addBuiltins(std::shared_ptr<Environment> env) {
-    env->set("+", std::make_shared<Expression>(std::make_shared<Function>([](const std::vector<ExprPtr>& args) {
-        double sum = 0;
-        for (auto& arg : args) {
-            if (!isNumber(arg)) {
-                throw std::runtime_error("Arguments to '+' must be numbers");
+    // Charges an object for memory it owns outside its own allocation
+    void resize(Object* obj, size_t size) {
+        size_t& generationBytes = obj->old ? oldBytes : youngBytes;
+        generationBytes = generationBytes - obj->size + size;
+        if (size > obj->size) {
+            stats.bytesAllocated += size - obj->size;
+        }
+        obj->size = static_cast<uint32_t>(size);
+    }
+
+    void collect(bool major) {
+        auto start = std::chrono::steady_clock::now();
+        if (!major && oldBytes > majorThreshold) {
+            major = true;
+        }
+        Tracer tracer(!major);
+        for (RootSet* roots : rootSets) {
+            roots->traceRoots(tracer);
+        }
+        for (Value* root : localRoots) {
+            tracer.mark(*root);
+        }
+        if (!major) {
+            for (Object* obj : remembered) {
+                obj->trace(tracer);
             }
-            sum += std::get<double>(arg->value);
         }
-        return std::make_shared<Expression>(sum);
-    })));
+        tracer.drain();
 
-    env->set("-", std::make_shared<Expression>(std::make_shared<Function>([](const std::vector<ExprPtr>& args) {
-        if (args.empty()) {
-            throw std::runtime_error("'-' requires at least one argument");
+        for (Object* obj : remembered) {
+            obj->remembered = false;
         }
-        if (!isNumber(args[0])) {
-            throw std::runtime_error("Arguments to '-' must be numbers");
+        remembered.clear();
+        if (major) {
+            sweepOld();
         }
-        double result = std::get<double>(args[0]->value);
-        if (args.size() == 1) {
-            return std::make_shared<Expression>(-result);
+        sweepYoung();
+
+        if (major) {
+            ++stats.majorCollections;
+            majorThreshold = std::max(minMajorThreshold, oldBytes * 2);
+        } else {
+            ++stats.minorCollections;
         }
-        for (size_t i = 1; i < args.size(); ++i) {
-            if (!isNumber(args[i])) {
-                throw std::runtime_error("Arguments to '-' must be numbers");
+        double pauseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats.totalPauseMs += pauseMs;
+        stats.maxPauseMs = std::max(stats.maxPauseMs, pauseMs);
+
+        if (heapLimit && liveBytes() > heapLimit) {
+            if (!major) {
+                collect(true);
+            } else {
+                throw std::runtime_error("Out of memory: heap limit exceeded");
             }
-            result -= std::get<double>(args[i]->value);
         }
-        return std::make_shared<Expression>(result);
-    })));
+    }
 
-    // Implement '*', '/', '<', '>', '==' similarly
-}
+private:
+    static constexpr size_t minMajorThreshold = 8 << 20;
 
-// Main
-int main() {
-    auto globalEnv = std::make_shared<Environment>();
-    addBuiltins(globalEnv);
+    // Objects of up to maxPooled bytes come from per-size free lists carved
+    // out of slabs, so allocating one pops a list and objects made one after
+    // another, like the pairs of a list being built, sit side by side.
+    // Freed slots go back to their list; slabs live as long as the heap.
+    static constexpr size_t poolGranule = 8;
+    static constexpr size_t maxPooled = 128;
+    static constexpr size_t slabBytes = 64 << 10;
+    void* freeSlots[maxPooled / poolGranule] = {};
+    std::vector<void*> slabs;
 
-    std::string line;
-    while (true) {
-        std::cout << "lisp> ";
-        if (!std::getline(std::cin, line)) {
-            break;
+    void* allocate(size_t size) {
+        if (size > maxPooled) {
+            return ::operator new(size);
         }
-        try {
-            ExprPtr expr = parse(line);
-            ExprPtr result = eval(expr, globalEnv);
-            if (isNumber(result)) {
-                std::cout << std::get<double>(result->value) << "\n";
-            } else if (isSymbol(result)) {
-                std::cout << std::get<std::string>(result->value) << "\n";
-            } else if (isFunction(result)) {
-                std::cout << "<function>\n";
-            } else if (isList(result)) {
-                std::cout << "<list>\n";
+        void*& head = freeSlots[(size - 1) / poolGranule];
+        if (!head) {
+            refill((size - 1) / poolGranule);
+        }
+        void* slot = head;
+        head = *static_cast<void**>(slot);
+        return slot;
+    }
+
+    void release(void* memory, size_t size) {
+        if (size > maxPooled) {
+            ::operator delete(memory);
+            return;
+        }
+        void*& head = freeSlots[(size - 1) / poolGranule];
+        *static_cast<void**>(memory) = head;
+        head = memory;
+    }
+
+    // Threads a new slab onto the list in address order
+    void refill(size_t sizeClass) {
+        size_t slotBytes = (sizeClass + 1) * poolGranule;
+        char* slab = static_cast<char*>(::operator new(slabBytes));
+        slabs.push_back(slab);
+        void*& head = freeSlots[sizeClass];
+        for (size_t offset = slabBytes / slotBytes * slotBytes; offset > 0; offset -= slotBytes) {
+            void* slot = slab + offset - slotBytes;
+            *static_cast<void**>(slot) = head;
+            head = slot;
+        }
+    }
+
+    Object* young = nullptr;
+    Object* oldest = nullptr;
+    size_t youngBytes = 0;
+    size_t oldBytes = 0;
+    size_t majorThreshold = minMajorThreshold;
+    bool frozen = false;
+    std::vector<Object*> remembered;
+    std::vector<RootSet*> rootSets;
+    std::vector<Value*> localRoots;
+
+    void destroy(Object* obj) {
+        stats.bytesFreed += obj->size;
+        size_t bytes = obj->allocatedBytes();
+        obj->~Object();
+        release(obj, bytes);
+    }
+
+    void freeList(Object* list) {
+        while (list) {
+            Object* next = list->next;
+            destroy(list);
+            list = next;
+        }
+    }
+
+    // Frees unmarked nursery objects and moves the survivors to the old list
+    void sweepYoung() {
+        Object* obj = young;
+        while (obj) {
+            Object* next = obj->next;
+            if (obj->marked) {
+                obj->marked = false;
+                obj->old = true;
+                obj->next = oldest;
+                oldest = obj;
+                oldBytes += obj->size;
+                stats.bytesPromoted += obj->size;
             } else {
-                std::cout << "Unknown result type\n";
+                destroy(obj);
             }
-        } catch (const std::exception& ex) {
-            std::cerr << "Error: " << ex.what() << "\n";
+            obj = next;
         }
+        young = nullptr;
+        youngBytes = 0;
     }
-    return 0;
+
+    void sweepOld() {
+        Object** link = &oldest;
+        while (Object* obj = *link) {
+            if (obj->marked) {
+                obj->marked = false;
+                link = &obj->next;
+            } else {
+                *link = obj->next;
+                oldBytes -= obj->size;
+                destroy(obj);
+            }
+        }
+    }
+};
+
+// What the running thread is working on: the heap, stack, VM and globals
+// of the interpreter instance it has entered (see Instance), and where
+// printed results go. A parallel call's worker also has tables of its own
+// for the caller's memoized functions, whose tables it may only read.
+class ValueStack;
+class VM;
+struct Globals;
+struct Memo;
+
+struct Context {
+    Heap* heap = nullptr;
+    ValueStack* stack = nullptr;
+    VM* vm = nullptr;
+    Globals* globals = nullptr;
+    std::ostream* out = &std::cout;
+    std::unordered_map<const Memo*, Memo*>* scratch = nullptr;
+};
+
+thread_local Context context;
+
+Heap& heap() {
+    return *context.heap;
+}
+
+// Switches the calling thread to another context until the scope ends
+class ContextScope {
+public:
+    explicit ContextScope(const Context& next) : saved(context) { context = next; }
+    ~ContextScope() { context = saved; }
+    ContextScope(const ContextScope&) = delete;
+    ContextScope& operator=(const ContextScope&) = delete;
+
+private:
+    Context saved;
+};
+
+// Keeps a C++ local visible to the collector while it is in scope
+class LocalRoot {
+public:
+    explicit LocalRoot(Value& value) { heap().pushRoot(&value); }
+    ~LocalRoot() { heap().popRoot(); }
+    LocalRoot(const LocalRoot&) = delete;
+    LocalRoot& operator=(const LocalRoot&) = delete;
+};
+
+// Environment
+// Globals are kept in a hash map shared by every frame; it is a GC root.
+struct Environment;
+
+// An instance's globals start out as a read-only `base`, the builtins
+// shared by every instance. A binding is copied out of it the first time it
+// is redefined or cached, so the base is never written and costs nothing to
+// share. While frozen, for a parallel call, the globals are read-only too.
+// Every base binding has already been copied, so the map is never written
+// while other threads read it.
+struct Globals : RootSet {
+    std::unordered_map<Symbol, Value, SymbolHash> vars;
+    const Globals* base;
+    Environment* root = nullptr; // the outermost, slotless environment
+    bool primitivesRebound = false; // + or - redefined, so typed calls must look them up
+
+    explicit Globals(Heap& owner, const Globals* base = nullptr) : base(base), owner(owner) {
+        owner.addRoots(this);
+    }
+
+    // The binding of a defined global, or null. Bindings are never removed
+    // and the map's nodes never move, so the cell outlives any redefinition
+    // and callers may keep it.
+    Value* cell(Symbol var) {
+        auto it = vars.find(var);
+        if (it != vars.end()) {
+            return &it->second;
+        }
+        const Value* inherited = base ? base->find(var) : nullptr;
+        return inherited ? &vars.emplace(var, *inherited).first->second : nullptr;
+    }
+
+    const Value* find(Symbol var) const {
+        auto it = vars.find(var);
+        if (it != vars.end()) {
+            return &it->second;
+        }
+        return base ? base->find(var) : nullptr;
+    }
+
+    // Freezes nest; only the outermost, made before any worker starts,
+    // copies the base bindings
+    void freeze() {
+        if (frozen.fetch_add(1) == 0 && base) {
+            for (const auto& entry : base->vars) {
+                vars.emplace(entry);
+            }
+        }
+    }
+
+    void thaw() { frozen.fetch_sub(1); }
+
+    bool isFrozen() const { return frozen.load(std::memory_order_relaxed) != 0; }
+
+    ~Globals() { owner.removeRoots(this); }
+    Globals(const Globals&) = delete;
+    Globals& operator=(const Globals&) = delete;
+
+    void traceRoots(Tracer& tracer) override;
+
+private:
+    Heap& owner;
+    std::atomic<unsigned> frozen{0};
+};
+
+// Lambda frame: one slot per parameter and internal define, addressed by
+// the (depth, slot) pairs assigned by the resolver. The slots are stored
+// inline after the object.
+struct Environment : Object {
+    Environment* outer;
+    Globals* globals;
+    uint32_t slotCount;
+
+    Environment(Environment* outer, Globals* globals, uint32_t frameSize)
+        : Object(ObjectType::Environment), outer(outer), globals(globals), slotCount(frameSize) {
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            new (&slots()[i]) Value();
+        }
+        LISP_STAT(AllocEnvironment);
+    }
+
+    // Allocates a frame; may collect, so `outer` must be reachable from a root
+    static Environment* create(Environment* outer, uint32_t frameSize) {
+        return heap().makeWithExtra<Environment>(frameSize * sizeof(Value), outer, outer->globals, frameSize);
+    }
+
+    static Environment* createGlobal(Globals& globals) {
+        globals.root = heap().make<Environment>(nullptr, &globals, 0);
+        return globals.root;
+    }
+
+    Value* slots() { return reinterpret_cast<Value*>(this + 1); }
+
+    Environment* frame(uint32_t depth) {
+        LISP_STAT_ADD(EnvDepthWalked, depth);
+        Environment* env = this;
+        while (depth-- > 0) {
+            env = env->outer;
+        }
+        return env;
+    }
+
+    const Value& lookup(uint32_t depth, uint32_t slot) {
+        LISP_STAT(EnvLocalLookups);
+        return frame(depth)->slots()[slot];
+    }
+
+    void store(uint32_t depth, uint32_t slot, const Value& value) {
+        Environment* env = frame(depth);
+        env->slots()[slot] = value;
+        heap().writeBarrier(env, value);
+    }
+
+    bool find(Symbol var, Value& result) const {
+        LISP_STAT(EnvGlobalLookups);
+        if (const Value* value = globals->find(var)) {
+            result = *value;
+            return true;
+        }
+        return false;
+    }
+
+    void set(Symbol var, Value value) {
+        if (globals->isFrozen()) {
+            throw std::runtime_error("Cannot define " + symbols().name(var) + " during a parallel call");
+        }
+        if ((var == symAdd || var == symSub) && globals->find(var)) {
+            globals->primitivesRebound = true;
+        }
+        globals->vars[var] = value;
+    }
+
+    void trace(Tracer& tracer) override {
+        tracer.mark(outer);
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            tracer.mark(slots()[i]);
+        }
+    }
+};
+
+void Globals::traceRoots(Tracer& tracer) {
+    tracer.mark(root);
+    for (auto& entry : vars) {
+        tracer.mark(entry.second);
+    }
+}
+
+inline Environment* Value::asEnvironment() const {
+    return static_cast<Environment*>(asObject());
+}
+
+// Arena
+// A bump allocator whose memory is released all at once when it is
+// destroyed. Nothing placed in it is destroyed individually, so it only
+// accepts trivially destructible types.
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        size_t padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+        if (size + padding > static_cast<size_t>(limit - cursor)) {
+            grow(size + align);
+            padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+        }
+        char* ptr = cursor + padding;
+        cursor = ptr + size;
+        return ptr;
+    }
+
+    template <typename T, typename... Params>
+    T* make(Params&&... params) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Params>(params)...);
+    }
+
+    template <typename T>
+    T* makeArray(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    size_t reserved() const { return reservedBytes; }
+
+private:
+    static constexpr size_t firstBlockSize = 4096;
+    static constexpr size_t maxBlockSize = 1 << 20;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* cursor = nullptr;
+    char* limit = nullptr;
+    size_t nextBlockSize = firstBlockSize;
+    size_t reservedBytes = 0;
+
+    void grow(size_t minimum) {
+        size_t size = std::max(nextBlockSize, minimum);
+        blocks.emplace_back(new char[size]);
+        reservedBytes += size;
+        cursor = blocks.back().get();
+        limit = cursor + size;
+        nextBlockSize = std::min(nextBlockSize * 2, maxBlockSize);
+    }
+};
+
+// A parsed program owns the arena its AST lives in and the bytecode compiled
+// from it. Closures hold a reference, so code lives as long as anything it
+// defined.
+struct Proto;
+
+struct Program : Object {
+    Arena arena;
+    std::vector<std::unique_ptr<Proto>> protos;
+    std::shared_ptr<void> image; // the loaded image its AST lives in, if any
+    size_t imageBytes = 0;
+    size_t protoBytes = 0;    // of protos[0, protosCharged)
+    size_t protosCharged = 0;
+
+    Program() : Object(ObjectType::Program) {}
+    ~Program() override;
+
+    // Charges the AST and bytecode to the heap so they count towards collection
+    void account();
+    size_t allocatedBytes() const override { return sizeof(Program); }
+
+    void trace(Tracer& tracer) override;
+};
+
+inline Program* Value::asProgram() const {
+    return static_cast<Program*>(asObject());
+}
+
+// A lambda form after resolution: its parameters, the size of the frame it
+// needs (parameters first, then internal defines) and its resolved body.
+struct Lambda {
+    const Symbol* params;
+    uint32_t arity;
+    uint32_t frameSize;
+    ExprPtr body;
+    Program* program;
+    Proto* proto = nullptr; // set once the bytecode compiler has seen it
+};
+
+// Builtins whose call with two numbers is computed inline by both engines,
+// without going through their BuiltinFunc
+enum class Arith : uint8_t {
+    None,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Less,
+    Greater,
+    Equal,
+};
+
+inline Arith arithFor(Symbol name) {
+    return name == symAdd ? Arith::Add : name == symSub ? Arith::Sub : name == symMul ? Arith::Mul
+         : name == symDiv ? Arith::Div : name == symLess ? Arith::Less : name == symGreater ? Arith::Greater
+         : name == symEqual ? Arith::Equal : Arith::None;
+}
+
+inline Value applyArith(Arith op, double x, double y) {
+    switch (op) {
+    case Arith::Add: return Value::number(x + y);
+    case Arith::Sub: return Value::number(x - y);
+    case Arith::Mul: return Value::number(x * y);
+    case Arith::Div: return Value::number(x / y);
+    case Arith::Less: return Value::number(x < y ? 1 : 0);
+    case Arith::Greater: return Value::number(x > y ? 1 : 0);
+    case Arith::Equal: return Value::number(x == y ? 1 : 0);
+    case Arith::None: break;
+    }
+    throw std::logic_error("Not an arithmetic builtin");
+}
+
+struct Function : Object {
+    Lambda* lambda = nullptr;
+    Program* program = nullptr; // keeps the lambda's code alive
+    Environment* env = nullptr;
+    BuiltinFunc builtin;
+    Arith arith = Arith::None; // set on the builtin that applyArith mirrors
+    Object* state = nullptr; // what a builtin made at run time works on, such as a memo table
+
+    // Constructor for user-defined functions
+    Function(Lambda* lambda, Environment* env)
+        : Object(ObjectType::Function), lambda(lambda), program(lambda->program), env(env) {
+        LISP_STAT(AllocFunction);
+    }
+
+    // Constructor for built-in functions
+    Function(BuiltinFunc builtin) : Object(ObjectType::Function), builtin(builtin) { LISP_STAT(AllocFunction); }
+
+    void trace(Tracer& tracer) override {
+        tracer.mark(program);
+        tracer.mark(env);
+        tracer.mark(state);
+    }
+};
+
+inline Function* Value::asFunction() const {
+    return static_cast<Function*>(asObject());
+}
+
+// A packed vector of numbers, stored inline after the object so the
+// kernels below run over the doubles directly
+struct Vector : Object {
+    size_t length;
+
+    explicit Vector(size_t length) : Object(ObjectType::Vector), length(length) {}
+
+    // Allocates an uninitialized vector; may collect
+    static Vector* create(size_t length) {
+        return heap().makeWithExtra<Vector>(length * sizeof(double), length);
+    }
+
+    double* data() { return reinterpret_cast<double*>(this + 1); }
+    const double* data() const { return reinterpret_cast<const double*>(this + 1); }
+
+    void trace(Tracer&) override {}
+};
+
+// The heap records object sizes in 32 bits
+const size_t maxVectorLength = (UINT32_MAX - sizeof(Vector)) / sizeof(double);
+
+inline Vector* Value::asVector() const {
+    return static_cast<Vector*>(asObject());
+}
+
+// The results of a memoized function by the bits of its arguments, which
+// must all be numbers. Entries are kept in least recently used order and
+// the oldest goes once there are `capacity` of them. The index is keyed by
+// a hash of the arguments alone, so of two entries whose hashes collide
+// only the newer is kept. The table is charged to the heap for what its
+// entries take.
+struct Memo : Object {
+    struct Entry {
+        uint64_t hash;
+        std::vector<uint64_t> args;
+        Value result;
+    };
+
+    Value target;
+    size_t capacity;
+    Heap* owner; // calls on any other heap, a parallel call's workers, fill a scratch table instead
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t entryBytes = 0;
+
+    Memo(Value target, size_t capacity) : Object(ObjectType::Memo), target(target), capacity(capacity), owner(&heap()) {}
+
+    size_t allocatedBytes() const override { return sizeof(Memo); }
+
+    void trace(Tracer& tracer) override {
+        tracer.mark(target);
+        for (const Entry& entry : entries) {
+            tracer.mark(entry.result);
+        }
+    }
+};
+
+const size_t defaultMemoCapacity = 4096;
+
+// A cons cell. A list is a chain of pairs linked through cdr and ended by
+// nil, the empty list. At 40 bytes a pair fills its pool slot exactly.
+struct Pair : Object {
+    Value car, cdr;
+
+    Pair(Value car, Value cdr) : Object(ObjectType::Pair), car(car), cdr(cdr) {}
+
+    // May collect, so whatever car and cdr refer to must be rooted
+    static Pair* create(Value car, Value cdr) {
+        return heap().make<Pair>(car, cdr);
+    }
+
+    void trace(Tracer& tracer) override {
+        tracer.mark(car);
+        tracer.mark(cdr);
+    }
+};
+
+inline Pair* Value::asPair() const {
+    return static_cast<Pair*>(asObject());
+}
+
+// A variable reference resolved to a lexical address: walk `depth` frames
+// out from the current environment and read `slot`.
+struct LocalRef {
+    Symbol name;
+    uint32_t depth;
+    uint32_t slot;
+};
+
+// The head of a call to + or - that the type checker proved takes and
+// returns numbers
+enum class Primitive : uint8_t {
+    Add,
+    Sub,
+};
+
+struct PrimitiveRef {
+    Symbol name;
+    Primitive op;
+};
+
+// AST
+// Nodes are allocated in their Program's arena and referenced by raw
+// pointers; a list's children are a contiguous array in the same arena.
+// The resolver rewrites Symbol nodes to Local and lambda forms to Lambda;
+// the type checker rewrites the heads of numeric calls to Primitive.
+struct ExprList {
+    ExprPtr* items;
+    uint32_t count;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    ExprPtr operator[](size_t i) const { return items[i]; }
+    ExprPtr* begin() const { return items; }
+    ExprPtr* end() const { return items + count; }
+};
+
+struct Expression {
+    enum class Kind : uint8_t {
+        Number,
+        Symbol,
+        List,
+        Local,
+        Lambda,
+        Primitive,
+    };
+
+    Kind kind;
+    union {
+        double number;
+        Symbol symbol;
+        ExprList list;
+        LocalRef local;
+        Lambda* lambda;
+        PrimitiveRef primitive;
+    };
+
+    explicit Expression(double num) : kind(Kind::Number), number(num) { LISP_STAT(AllocExpression); }
+    explicit Expression(Symbol sym) : kind(Kind::Symbol), symbol(sym) { LISP_STAT(AllocExpression); }
+    explicit Expression(ExprList items) : kind(Kind::List), list(items) { LISP_STAT(AllocExpression); }
+};
+
+
+// Parsing
+// Children of the lists being parsed are gathered on a scratch stack and
+// copied into the arena when each list closes, so the only allocations are
+// arena bumps.
+class Parser {
+public:
+    Parser(std::string_view source, Program& program) : lexer(source), arena(program.arena) {}
+
+    ExprPtr parseExpression() {
+        Token token = lexer.next();
+        if (token.type == TokenType::NUMBER) {
+            return arena.make<Expression>(parseNumber(token.text));
+        } else if (token.type == TokenType::SYMBOL) {
+            return arena.make<Expression>(intern(token.text));
+        } else if (token.type == TokenType::PAREN_OPEN) {
+            return parseList();
+        } else if (token.type == TokenType::END) {
+            throw std::runtime_error("Unexpected end of input");
+        } else {
+            throw std::runtime_error("Unexpected token");
+        }
+    }
+
+    bool atEnd() { return lexer.peek().type == TokenType::END; }
+    size_t offset() { return lexer.offset(); }
+
+private:
+    Lexer lexer;
+    Arena& arena;
+    std::vector<ExprPtr> scratch;
+
+    static double parseNumber(std::string_view text) {
+        double num = 0;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), num);
+        if (result.ec != std::errc()) {
+            throw std::runtime_error("Invalid number: " + std::string(text));
+        }
+        return num;
+    }
+
+    // Called with the opening paren already consumed
+    ExprPtr parseList() {
+        size_t first = scratch.size();
+        while (lexer.peek().type != TokenType::PAREN_CLOSE) {
+            if (lexer.peek().type == TokenType::END) {
+                throw std::runtime_error("Missing closing parenthesis");
+            }
+            ExprPtr item = parseExpression();
+            scratch.push_back(item);
+        }
+        lexer.next(); // Skip ')'
+        uint32_t count = static_cast<uint32_t>(scratch.size() - first);
+        ExprPtr* items = arena.makeArray<ExprPtr>(count);
+        std::copy(scratch.begin() + first, scratch.end(), items);
+        scratch.resize(first);
+        return arena.make<Expression>(ExprList{items, count});
+    }
+};
+
+ExprPtr parse(std::string_view code, Program& program) {
+    LISP_STAT_TIME(ParseNs);
+    LISP_STAT(ParseForms);
+    ExprPtr expr = Parser(code, program).parseExpression();
+    program.account();
+    return expr;
+}
+
+// A top-level form and the offset it starts at, for error messages
+struct Form {
+    ExprPtr expr;
+    size_t offset;
+};
+
+// Parses every form in the source, which may span any number of lines.
+// `current`, if given, tracks the start of the form being parsed so a
+// syntax error can be located.
+std::vector<Form> parseAll(std::string_view code, Program& program, size_t* current = nullptr) {
+    LISP_STAT_TIME(ParseNs);
+    std::vector<Form> forms;
+    Parser parser(code, program);
+    while (!parser.atEnd()) {
+        size_t offset = parser.offset();
+        if (current) {
+            *current = offset;
+        }
+        forms.push_back({parser.parseExpression(), offset});
+        LISP_STAT(ParseForms);
+    }
+    program.account();
+    return forms;
+}
+
+// Evaluation
+bool isSymbol(ExprPtr expr) {
+    return expr->kind == Expression::Kind::Symbol;
+}
+
+bool isNumber(ExprPtr expr) {
+    return expr->kind == Expression::Kind::Number;
+}
+
+bool isList(ExprPtr expr) {
+    return expr->kind == Expression::Kind::List;
+}
+
+bool isLocal(ExprPtr expr) {
+    return expr->kind == Expression::Kind::Local;
+}
+
+bool isLambda(ExprPtr expr) {
+    return expr->kind == Expression::Kind::Lambda;
+}
+
+bool isPrimitive(ExprPtr expr) {
+    return expr->kind == Expression::Kind::Primitive;
+}
+
+bool isKeyword(ExprPtr expr, Symbol keyword) {
+    return isSymbol(expr) && expr->symbol == keyword;
+}
+
+// Resolution
+// A pre-pass over a parsed form that gives every reference to a lambda
+// parameter or internal define a static (depth, slot) address and lowers
+// lambda forms to Lambda nodes. Symbols without a lexical binding are left
+// alone and looked up in the global environment at run time.
+class Resolver {
+public:
+    explicit Resolver(Program& program) : program(program) {}
+
+    ExprPtr resolve(ExprPtr expr) {
+        resolveExpr(expr);
+        return expr;
+    }
+
+private:
+    struct Scope {
+        std::unordered_map<Symbol, uint32_t, SymbolHash> slots;
+        uint32_t size = 0;
+    };
+
+    Program& program;
+    std::vector<Scope> scopes;
+
+    void resolveExpr(ExprPtr expr) {
+        if (isSymbol(expr)) {
+            resolveSymbol(expr);
+            return;
+        }
+        if (!isList(expr) || expr->list.empty()) {
+            return;
+        }
+        lowerDefineMemo(expr);
+        const ExprList& list = expr->list;
+        size_t first = 0;
+        if (isKeyword(list[0], symLambda)) {
+            resolveLambda(expr);
+            return;
+        } else if (isKeyword(list[0], symDefine) || isKeyword(list[0], symIf)) {
+            first = 1; // keep the keyword itself unresolved
+        }
+        for (size_t i = first; i < list.size(); ++i) {
+            resolveExpr(list[i]);
+        }
+    }
+
+    void resolveSymbol(ExprPtr expr) {
+        Symbol sym = expr->symbol;
+        for (size_t i = scopes.size(); i-- > 0;) {
+            auto it = scopes[i].slots.find(sym);
+            if (it != scopes[i].slots.end()) {
+                uint32_t depth = static_cast<uint32_t>(scopes.size() - 1 - i);
+                expr->kind = Expression::Kind::Local;
+                expr->local = LocalRef{sym, depth, it->second};
+                return;
+            }
+        }
+    }
+
+    void resolveLambda(ExprPtr expr) {
+        // (lambda (params) body)
+        const ExprList& list = expr->list;
+        if (list.size() != 3 || !isList(list[1])) {
+            throw std::runtime_error("Invalid lambda syntax");
+        }
+        const ExprList& paramList = list[1]->list;
+        Symbol* params = program.arena.makeArray<Symbol>(paramList.size());
+        Scope scope;
+        for (size_t i = 0; i < paramList.size(); ++i) {
+            if (!isSymbol(paramList[i])) {
+                throw std::runtime_error("Lambda parameters must be symbols");
+            }
+            params[i] = paramList[i]->symbol;
+            scope.slots[params[i]] = scope.size++;
+        }
+        Lambda* lambda = program.arena.make<Lambda>();
+        lambda->params = params;
+        lambda->arity = static_cast<uint32_t>(paramList.size());
+        lambda->body = list[2];
+        lambda->program = &program;
+        declareDefines(lambda->body, scope);
+        lambda->frameSize = scope.size;
+
+        scopes.push_back(std::move(scope));
+        resolveExpr(lambda->body);
+        scopes.pop_back();
+
+        expr->kind = Expression::Kind::Lambda;
+        expr->lambda = lambda;
+    }
+
+    // Internal defines get a slot in the enclosing lambda's frame. Nested
+    // lambdas are skipped since they get frames of their own.
+    void declareDefines(ExprPtr expr, Scope& scope) {
+        if (!isList(expr) || expr->list.empty()) {
+            return;
+        }
+        lowerDefineMemo(expr);
+        const ExprList& list = expr->list;
+        if (isKeyword(list[0], symLambda)) {
+            return;
+        }
+        if (isKeyword(list[0], symDefine) && list.size() == 3 && isSymbol(list[1])) {
+            Symbol sym = list[1]->symbol;
+            if (scope.slots.find(sym) == scope.slots.end()) {
+                scope.slots[sym] = scope.size++;
+            }
+        }
+        for (ExprPtr item : list) {
+            declareDefines(item, scope);
+        }
+    }
+
+    // (define-memo name value) becomes (define name (memoize value)), in
+    // place, before anything else looks at it
+    void lowerDefineMemo(ExprPtr expr) {
+        const ExprList& list = expr->list;
+        if (!isKeyword(list[0], symDefineMemo)) {
+            return;
+        }
+        if (list.size() != 3 || !isSymbol(list[1])) {
+            throw std::runtime_error("Invalid define-memo syntax");
+        }
+        ExprPtr* call = program.arena.makeArray<ExprPtr>(2);
+        call[0] = program.arena.make<Expression>(symMemoize);
+        call[1] = list[2];
+        list[0]->symbol = symDefine;
+        list.items[2] = program.arena.make<Expression>(ExprList{call, 2});
+    }
+};
+
+ExprPtr resolve(ExprPtr expr, Program& program) {
+    return Resolver(program).resolve(expr);
+}
+
+// Type inference
+// An optional Hindley-Milner pass over resolved top-level forms, built on
+// the unifier. Numbers are Num, a list is a (List a) compound of its
+// element type, and (stats), which returns nothing useful, is Nil. A
+// function type is a -> compound of its parameter types followed by its
+// result, so arity is part of the type.
+// Globals defined at top level are generalized; lambda parameters and
+// internal defines are monomorphic.
+//
+// Once a form checks, calls of + and - are lowered to Primitive heads,
+// which the engines run without looking the builtin up or checking its
+// arguments. A checked program therefore never raises a type error at run
+// time. A global may only be redefined with the type it already has.
+class TypeChecker {
+public:
+    TypeChecker() : num(factory.constant("Num")), nil(factory.constant("Nil")) {
+        auto arithmetic = functionType({num, num}, num);
+        schemes[symAdd] = {arithmetic, {}, true};
+        schemes[symSub] = {arithmetic, {}, true};
+        for (Symbol name : {symMul, symDiv, symLess, symGreater, symEqual}) {
+            schemes[name] = {arithmetic, {}, false};
+        }
+        // vec is variadic, so it has no type; vectors are built from these
+        auto vec = factory.constant("Vec");
+        schemes[intern("make-vec")] = {functionType({num, num}, vec), {}, false};
+        schemes[intern("vec-range")] = {functionType({num}, vec), {}, false};
+        schemes[intern("vec-len")] = {functionType({vec}, num), {}, false};
+        schemes[intern("vec-ref")] = {functionType({vec, num}, num), {}, false};
+        schemes[intern("vec-add")] = {functionType({vec, vec}, vec), {}, false};
+        schemes[intern("vec-mul")] = {functionType({vec, vec}, vec), {}, false};
+        schemes[intern("dot")] = {functionType({vec, vec}, num), {}, false};
+        schemes[intern("sum")] = {functionType({vec}, num), {}, false};
+        schemes[intern("map-num")] = {functionType({functionType({num}, num), vec}, vec), {}, false};
+        schemes[intern("stats")] = {functionType({}, nil), {}, false};
+
+        // list is variadic, so it has no type; lists are built with cons
+        auto a = factory.fresh(), b = factory.fresh();
+        auto listA = listType(a);
+        schemes[intern("cons")] = generalize(functionType({a, listA}, listA));
+        schemes[intern("car")] = generalize(functionType({listA}, a));
+        schemes[intern("cdr")] = generalize(functionType({listA}, listA));
+        schemes[intern("null?")] = generalize(functionType({listA}, num));
+        schemes[intern("pair?")] = generalize(functionType({a}, num));
+        schemes[intern("length")] = generalize(functionType({listA}, num));
+        schemes[intern("map")] = generalize(functionType({functionType({a}, b), listA}, listType(b)));
+        schemes[intern("filter")] = generalize(functionType({functionType({a}, num), listA}, listA));
+        schemes[intern("reduce")] = generalize(functionType({functionType({b, a}, b), b, listA}, b));
+        schemes[intern("pmap")] = schemes[intern("map")];
+        schemes[intern("preduce")] = generalize(functionType({functionType({a, a}, a), a, listA}, a));
+    }
+
+    // Throws a "Type error" and leaves the form untouched if it has no type
+    void check(ExprPtr form) {
+        factory.clear(); // what earlier forms built lives on only in their schemes
+        frames.clear();
+        lowered.clear();
+        undo.pending = false;
+        if (isList(form) && form->list.size() == 3 && isKeyword(form->list[0], symDefine) &&
+            isSymbol(form->list[1])) {
+            checkDefine(form->list[1]->symbol, form->list[2]);
+        } else {
+            infer(form);
+        }
+        for (ExprPtr head : lowered) {
+            Symbol name = head->symbol;
+            head->kind = Expression::Kind::Primitive;
+            head->primitive = PrimitiveRef{name, name == symAdd ? Primitive::Add : Primitive::Sub};
+        }
+    }
+
+    // Puts back the scheme of the global the last checked form defined, for
+    // when running the form fails and the global keeps its old value
+    void rollback() {
+        if (undo.pending) {
+            undo.pending = false;
+            restore(undo.name, undo.redefining, std::move(undo.saved));
+        }
+    }
+
+    // Variables are named a, b, ... in order of appearance
+    std::string show(const std::shared_ptr<Type>& type) const {
+        std::unordered_map<const Type*, std::string> names;
+        std::string out;
+        print(type->apply({}, factory).get(), names, out);
+        return out;
+    }
+
+private:
+    struct Scheme {
+        std::shared_ptr<Type> type;
+        std::vector<std::string> quantified; // variables renamed at each use
+        bool primitive = false;              // still the builtin, so calls can be lowered
+    };
+
+    // Types are built here rather than in the shared types(), so they are
+    // freed with the checker, and what a form leaves behind with the next
+    mutable TypeFactory factory; // show() builds too
+    std::shared_ptr<Type> num, nil;
+    std::unordered_map<Symbol, Scheme, SymbolHash> schemes;
+    std::vector<std::vector<std::shared_ptr<Type>>> frames; // slot types of enclosing lambdas, innermost last
+    std::vector<ExprPtr> lowered;                           // heads of + and - calls in the current form
+
+    // The scheme the current form's define replaced, if it checked
+    struct Undo {
+        bool pending = false;
+        Symbol name{};
+        bool redefining = false;
+        Scheme saved;
+    } undo;
+
+    std::shared_ptr<Type> functionType(std::vector<std::shared_ptr<Type>> params, std::shared_ptr<Type> result) {
+        params.push_back(std::move(result));
+        return factory.compound("->", std::move(params));
+    }
+
+    std::shared_ptr<Type> listType(std::shared_ptr<Type> element) {
+        return factory.compound("List", {std::move(element)});
+    }
+
+    void expect(const std::shared_ptr<Type>& actual, const std::shared_ptr<Type>& expected) {
+        // A failed attempt is rolled back so the message shows the types as
+        // they were, and the form leaves no bindings behind
+        Trail trail;
+        UnifyState state{OccursCheck::Eager, {}, {}, {}, {}, &trail};
+        if (!unifyCells(actual, expected, state)) {
+            trail.undoTo(0);
+            // Both sides share one naming, so a variable reads the same in each
+            std::unordered_map<const Type*, std::string> names;
+            std::string message = "Type error: expected ";
+            print(expected->apply({}, factory).get(), names, message);
+            message += ", got ";
+            print(actual->apply({}, factory).get(), names, message);
+            if (state.error.compare(0, 6, "Occurs") == 0) {
+                message += " (infinite type)";
+            }
+            throw std::runtime_error(message);
+        }
+    }
+
+    std::shared_ptr<Type> instantiate(const Scheme& scheme) {
+        if (scheme.quantified.empty()) {
+            return scheme.type;
+        }
+        std::unordered_map<std::string, std::shared_ptr<Type>> fresh;
+        for (const std::string& name : scheme.quantified) {
+            fresh[name] = factory.fresh();
+        }
+        return scheme.type->apply(fresh, factory);
+    }
+
+    // Every global scheme is closed, so at top level all free variables of
+    // a type can be quantified
+    Scheme generalize(const std::shared_ptr<Type>& type) {
+        Scheme scheme{type->apply({}, factory), {}, false};
+        std::unordered_set<std::string> vars;
+        scheme.type->collectFreeTypeVars(vars);
+        scheme.quantified.assign(vars.begin(), vars.end());
+        return scheme;
+    }
+
+    // The name is bound to a fresh variable while its value is checked, so
+    // a function may call itself
+    void checkDefine(Symbol name, ExprPtr value) {
+        auto prior = schemes.find(name);
+        bool redefining = prior != schemes.end();
+        Scheme saved = redefining ? prior->second : Scheme{};
+        auto self = factory.fresh();
+        schemes[name] = Scheme{self, {}, false};
+        try {
+            expect(infer(value), self);
+            Scheme scheme = generalize(self);
+            if (redefining && show(scheme.type) != show(saved.type)) {
+                throw std::runtime_error("Type error: " + symbols().name(name) + " has type " + show(saved.type) +
+                                         " and cannot be redefined as " + show(scheme.type));
+            }
+            schemes[name] = std::move(scheme);
+        } catch (...) {
+            restore(name, redefining, std::move(saved));
+            throw;
+        }
+        undo = {true, name, redefining, std::move(saved)};
+    }
+
+    void restore(Symbol name, bool redefining, Scheme saved) {
+        if (redefining) {
+            schemes[name] = std::move(saved);
+        } else {
+            schemes.erase(name);
+        }
+    }
+
+    std::shared_ptr<Type> infer(ExprPtr expr) {
+        if (isNumber(expr)) {
+            return num;
+        } else if (isLocal(expr)) {
+            const LocalRef& ref = expr->local;
+            return frames[frames.size() - 1 - ref.depth][ref.slot];
+        } else if (isSymbol(expr)) {
+            auto it = schemes.find(expr->symbol);
+            if (it == schemes.end()) {
+                throw std::runtime_error("Type error: undefined global " + symbols().name(expr->symbol));
+            }
+            return instantiate(it->second);
+        } else if (isLambda(expr)) {
+            const Lambda& lambda = *expr->lambda;
+            std::vector<std::shared_ptr<Type>> slots(lambda.frameSize);
+            for (auto& slot : slots) {
+                slot = factory.fresh();
+            }
+            frames.push_back(slots);
+            auto result = infer(lambda.body);
+            frames.pop_back();
+            slots.resize(lambda.arity);
+            return functionType(std::move(slots), result);
+        } else if (!isList(expr)) {
+            throw std::runtime_error("Invalid expression");
+        }
+
+        const ExprList& list = expr->list;
+        if (list.empty()) {
+            return listType(factory.fresh());
+        }
+        ExprPtr first = list[0];
+        if (isKeyword(first, symDefine)) {
+            // Internal define; global ones are handled by checkDefine
+            if (list.size() != 3 || !(isSymbol(list[1]) || isLocal(list[1]))) {
+                throw std::runtime_error("Invalid define syntax");
+            }
+            if (isSymbol(list[1])) {
+                throw std::runtime_error("Type error: global " + symbols().name(list[1]->symbol) +
+                                         " must be defined at top level");
+            }
+            auto type = infer(list[2]);
+            expect(type, infer(list[1]));
+            return type;
+        } else if (isKeyword(first, symIf)) {
+            // Any value can be a condition
+            if (list.size() != 4) {
+                throw std::runtime_error("Invalid if syntax");
+            }
+            infer(list[1]);
+            auto type = infer(list[2]);
+            expect(infer(list[3]), type);
+            return type;
+        }
+
+        if (isKeyword(first, symMemoize) && !schemes.count(symMemoize) && (list.size() == 2 || list.size() == 3)) {
+            // The builtin has a type for each arity: that of its argument
+            if (list.size() == 3) {
+                expect(infer(list[2]), num);
+            }
+            return infer(list[1]);
+        }
+        if (isSymbol(first) && (first->symbol == symAdd || first->symbol == symSub)) {
+            auto it = schemes.find(first->symbol);
+            if (it != schemes.end() && it->second.primitive) {
+                if (first->symbol == symSub && list.size() < 2) {
+                    throw std::runtime_error("Type error: '-' requires at least one argument");
+                }
+                for (size_t i = 1; i < list.size(); ++i) {
+                    expect(infer(list[i]), num);
+                }
+                lowered.push_back(first);
+                return num;
+            }
+        }
+        auto callee = infer(first);
+        std::vector<std::shared_ptr<Type>> args;
+        for (size_t i = 1; i < list.size(); ++i) {
+            args.push_back(infer(list[i]));
+        }
+        auto result = factory.fresh();
+        expect(callee, functionType(std::move(args), result));
+        return result;
+    }
+
+    void print(const Type* type, std::unordered_map<const Type*, std::string>& names, std::string& out) const {
+        if (type->kind == TypeKind::Variable) {
+            std::string& name = names[type];
+            if (name.empty()) {
+                size_t n = names.size() - 1;
+                name = std::string(1, static_cast<char>('a' + n % 26)) + (n < 26 ? "" : std::to_string(n / 26));
+            }
+            out += name;
+        } else if (type->kind == TypeKind::Constant) {
+            out += static_cast<const TypeConstant*>(type)->name;
+        } else if (type->kind == TypeKind::Compound && static_cast<const TypeCompound*>(type)->name != "->") {
+            // Lists, as (List a)
+            auto& compound = *static_cast<const TypeCompound*>(type);
+            out += "(" + compound.name;
+            for (const auto& arg : compound.args) {
+                out += " ";
+                print(arg.get(), names, out);
+            }
+            out += ")";
+        } else if (type->kind == TypeKind::Compound) {
+            // Functions, as (params -> result)
+            auto& args = static_cast<const TypeCompound*>(type)->args;
+            out += "(";
+            for (size_t i = 0; i + 1 < args.size(); ++i) {
+                print(args[i].get(), names, out);
+                out += " ";
+            }
+            out += "-> ";
+            print(args.back().get(), names, out);
+            out += ")";
+        }
+    }
+};
+
+// Evaluation stack shared by eval and the VM. Its capacity is reserved up
+// front so an Args view into it stays valid while nested calls push more.
+// Everything on it is a GC root.
+class ValueStack : public RootSet {
+public:
+    ValueStack(Heap& owner, size_t capacity) : owner(owner) {
+        values.reserve(capacity);
+        owner.addRoots(this);
+    }
+
+    ~ValueStack() { owner.removeRoots(this); }
+    ValueStack(const ValueStack&) = delete;
+    ValueStack& operator=(const ValueStack&) = delete;
+
+    void traceRoots(Tracer& tracer) override {
+        for (const Value& value : values) {
+            tracer.mark(value);
+        }
+    }
+
+    void push(Value value) {
+        if (values.size() == values.capacity()) {
+            throw std::runtime_error("Stack overflow");
+        }
+        values.push_back(value);
+    }
+
+    Value pop() {
+        Value value = values.back();
+        values.pop_back();
+        return value;
+    }
+
+    Value& back() { return values.back(); }
+    Value& operator[](size_t i) { return values[i]; }
+    size_t size() const { return values.size(); }
+
+    void truncate(size_t size) {
+        values.erase(values.begin() + size, values.end());
+    }
+
+    Args args(size_t first) const {
+        return {values.data() + first, values.size() - first};
+    }
+
+private:
+    Heap& owner;
+    std::vector<Value> values;
+};
+
+ValueStack& valueStack() {
+    return *context.stack;
+}
+
+// Pops everything pushed above a saved height when it goes out of scope
+struct StackMark {
+    ValueStack& stack;
+    size_t height;
+
+    explicit StackMark(ValueStack& stack) : stack(stack), height(stack.size()) {}
+    ~StackMark() { stack.truncate(height); }
+};
+
+// Bounds native recursion in eval, which only happens for calls that are
+// not in tail position, and in VM::run, which is re-entered whenever a
+// builtin such as map calls back into a closure, so runaway recursion
+// reports an error instead of overflowing the C++ stack.
+// The count is per thread, like the native stack it guards.
+const size_t maxEvalDepth = 10000;
+thread_local size_t evalDepth = 0;
+
+struct EvalDepthGuard {
+    EvalDepthGuard() {
+        if (++evalDepth > maxEvalDepth) {
+            --evalDepth;
+            throw std::runtime_error("Stack overflow");
+        }
+    }
+    ~EvalDepthGuard() { --evalDepth; }
+};
+
+Value eval(ExprPtr form, Environment* formEnv) {
+    EvalDepthGuard depthGuard;
+    // Expressions in tail position (if branches and function bodies) are
+    // evaluated by looping here rather than recursing, so tail calls run in
+    // constant C++ stack and each call's frame becomes garbage at the next.
+    ExprPtr expr = form;
+    Value frame = Value::object(formEnv); // environment of the running tail call
+    Value callee;                         // keeps the running function's body alive
+    LocalRoot frameRoot(frame), calleeRoot(callee);
+
+    while (true) {
+        Environment* env = frame.asEnvironment();
+
+        if (isLocal(expr)) {
+            // Lexically addressed variable
+            LISP_STAT(EvalLocal);
+            const LocalRef& ref = expr->local;
+            const Value& value = env->lookup(ref.depth, ref.slot);
+            if (value.isUndefined()) {
+                throw std::runtime_error("Undefined symbol: " + symbols().name(ref.name));
+            }
+            return value;
+        } else if (isSymbol(expr) || isPrimitive(expr)) {
+            // Global variable lookup
+            LISP_STAT(EvalGlobal);
+            Value result;
+            Symbol sym = isSymbol(expr) ? expr->symbol : expr->primitive.name;
+            if (env->find(sym, result)) {
+                return result;
+            } else {
+                throw std::runtime_error("Undefined symbol: " + symbols().name(sym));
+            }
+        } else if (isNumber(expr)) {
+            // Numbers evaluate to themselves
+            LISP_STAT(EvalNumber);
+            return Value::number(expr->number);
+        } else if (isLambda(expr)) {
+            // Resolved (lambda (params) body)
+            LISP_STAT(EvalLambda);
+            return Value::object(heap().make<Function>(expr->lambda, env));
+        } else if (isList(expr)) {
+            const ExprList& list = expr->list;
+            if (list.empty()) {
+                return Value::nil();
+            }
+
+            // Get the first element to determine the operation
+            ExprPtr first = list[0];
+
+            if (isKeyword(first, symDefine)) {
+                // (define var expr)
+                LISP_STAT(EvalDefine);
+                if (list.size() != 3 || !(isSymbol(list[1]) || isLocal(list[1]))) {
+                    throw std::runtime_error("Invalid define syntax");
+                }
+                Value value = eval(list[2], env);
+                if (isLocal(list[1])) {
+                    const LocalRef& ref = list[1]->local;
+                    env->store(ref.depth, ref.slot, value);
+                } else {
+                    env->set(list[1]->symbol, value);
+                }
+                return value;
+            } else if (isKeyword(first, symIf)) {
+                // (if cond then else)
+                LISP_STAT(EvalIf);
+                if (list.size() != 4) {
+                    throw std::runtime_error("Invalid if syntax");
+                }
+                expr = eval(list[1], env).isTruthy() ? list[2] : list[3];
+                continue;
+            } else if (isPrimitive(first) && !env->globals->primitivesRebound) {
+                // Type-checked (+ ...) or (- ...): the arguments are numbers
+                LISP_STAT(EvalPrimitive);
+                bool add = first->primitive.op == Primitive::Add;
+                double result = add ? 0 : eval(list[1], env).asNumber();
+                if (!add && list.size() == 2) {
+                    return Value::number(-result);
+                }
+                for (size_t i = add ? 1 : 2; i < list.size(); ++i) {
+                    double arg = eval(list[i], env).asNumber();
+                    result = add ? result + arg : result - arg;
+                }
+                return Value::number(result);
+            } else {
+                // Function application: the callee and its arguments are
+                // evaluated onto the shared stack, which keeps them rooted
+                LISP_STAT(EvalCall);
+                ValueStack& stack = valueStack();
+                StackMark mark(stack);
+                for (ExprPtr item : list) {
+                    stack.push(eval(item, env));
+                }
+                if (!stack[mark.height].isFunction()) {
+                    throw std::runtime_error("First element is not a function");
+                }
+                Function& func = *stack[mark.height].asFunction();
+                size_t first = mark.height + 1;
+
+                if (func.arith != Arith::None && stack.size() - first == 2 && stack[first].isNumber() &&
+                    stack[first + 1].isNumber()) {
+                    return applyArith(func.arith, stack[first].asNumber(), stack[first + 1].asNumber());
+                }
+                if (func.builtin) {
+                    // Built-in function
+                    return func.builtin(stack.args(first));
+                }
+
+                // User-defined function: continue with its body as a tail call
+                const Lambda& lambda = *func.lambda;
+                size_t argc = stack.size() - first;
+                if (argc != lambda.arity) {
+                    throw std::runtime_error("Incorrect number of arguments");
+                }
+                Environment* localEnv = Environment::create(func.env, lambda.frameSize);
+                for (size_t i = 0; i < argc; ++i) {
+                    localEnv->slots()[i] = stack[first + i];
+                }
+                frame = Value::object(localEnv);
+                callee = stack[mark.height];
+                expr = lambda.body;
+                continue;
+            }
+        }
+
+        throw std::runtime_error("Invalid expression");
+    }
+}
+
+// Bytecode
+// The compiler lowers a resolved form into a Proto: a flat instruction
+// array plus its constants and nested lambdas. Each lambda is compiled to a
+// Proto of its own, cached on the Lambda node so closures created by the VM
+// can be called without recompiling.
+#define LISP_OPCODES(X) \
+    X(PushConst)        /* a: constant index */ \
+    X(LoadLocal)        /* a: slot, b: depth; parameters are always bound */ \
+    X(LoadLocalChecked) /* a: index into Proto::locals; internal defines */ \
+    X(LoadGlobal)       /* a: index into Proto::globals */ \
+    X(StoreLocal)       /* a: slot, b: depth; leaves the value on the stack */ \
+    X(StoreGlobal)      /* a: symbol id; leaves the value on the stack */ \
+    X(MakeClosure)      /* a: index into Proto::lambdas */ \
+    X(Jump)             /* a: target pc */ \
+    X(JumpIfFalse)      /* a: target pc; pops the condition */ \
+    X(Call)             /* a: argument count */ \
+    X(TailCall)         /* a: argument count */ \
+    X(AddNum)           /* a: argument count; type-checked +, all numbers */ \
+    X(SubNum)           /* a: argument count; type-checked -, all numbers */ \
+    X(CallArith)        /* a: index into Proto::globals, b: Arith; two arguments */ \
+    X(Return)
+
+enum class Op : uint8_t {
+#define LISP_OPCODE_ENUM(name) name,
+    LISP_OPCODES(LISP_OPCODE_ENUM)
+#undef LISP_OPCODE_ENUM
+};
+
+struct Instr {
+    Op op;
+    uint16_t b;
+    uint32_t a;
+};
+
+// A global read by a Proto, with the binding cell it was last found in.
+// The cell stays valid across redefinitions, so it is only looked up again
+// when the code runs against another set of globals. Workers of a parallel
+// call share the code, so the owner is published after the cell: a thread
+// that sees the owner sees its cell.
+struct GlobalCache {
+    Symbol name;
+    std::atomic<Globals*> owner{nullptr};
+    std::atomic<Value*> cell{nullptr};
+
+    explicit GlobalCache(Symbol name) : name(name) {}
+    GlobalCache(const GlobalCache& other) : name(other.name), owner(other.owner.load()), cell(other.cell.load()) {}
+};
+
+struct Proto {
+    std::vector<Instr> code;
+    std::vector<Value> constants;
+    std::vector<Lambda*> lambdas;
+    std::vector<LocalRef> locals;
+    mutable std::vector<GlobalCache> globals; // filled in as the code runs
+};
+
+Program::~Program() = default;
+
+// A proto does not grow once compiled, so each is summed only the first
+// time; a program that compiles form after form stays linear
+void Program::account() {
+    for (; protosCharged < protos.size(); ++protosCharged) {
+        const Proto& proto = *protos[protosCharged];
+        protoBytes += sizeof(Proto) + proto.code.capacity() * sizeof(Instr) +
+                      proto.constants.capacity() * sizeof(Value) + proto.globals.capacity() * sizeof(GlobalCache);
+    }
+    heap().resize(this, sizeof(Program) + arena.reserved() + imageBytes + protoBytes);
+}
+
+void Program::trace(Tracer& tracer) {
+    for (auto& proto : protos) {
+        for (const Value& constant : proto->constants) {
+            tracer.mark(constant);
+        }
+    }
+}
+
+class Compiler {
+public:
+    explicit Compiler(Program& program) : program(program) {}
+
+    std::unique_ptr<Proto> compile(ExprPtr expr) {
+        auto proto = std::make_unique<Proto>();
+        out = proto.get();
+        compileExpr(expr, true);
+        return proto;
+    }
+
+private:
+    Program& program;
+    Proto* out = nullptr;
+    std::vector<const Lambda*> lambdas; // enclosing lambdas, innermost last
+
+    uint32_t emit(Op op, uint32_t a = 0, uint16_t b = 0) {
+        out->code.push_back({op, b, a});
+        return static_cast<uint32_t>(out->code.size() - 1);
+    }
+
+    uint32_t constant(Value value) {
+        out->constants.push_back(std::move(value));
+        return static_cast<uint32_t>(out->constants.size() - 1);
+    }
+
+    uint32_t global(Symbol name) {
+        for (size_t i = 0; i < out->globals.size(); ++i) {
+            if (out->globals[i].name == name) {
+                return static_cast<uint32_t>(i);
+            }
+        }
+        out->globals.emplace_back(name);
+        return static_cast<uint32_t>(out->globals.size() - 1);
+    }
+
+    uint32_t here() const {
+        return static_cast<uint32_t>(out->code.size());
+    }
+
+    void compileExpr(ExprPtr expr, bool tail) {
+        if (isLocal(expr)) {
+            const LocalRef& ref = expr->local;
+            if (ref.depth > UINT16_MAX) {
+                throw std::runtime_error("Lambda nesting too deep");
+            }
+            const Lambda* owner = lambdas[lambdas.size() - 1 - ref.depth];
+            if (ref.slot < owner->arity) {
+                emit(Op::LoadLocal, ref.slot, static_cast<uint16_t>(ref.depth));
+            } else {
+                out->locals.push_back(ref);
+                emit(Op::LoadLocalChecked, static_cast<uint32_t>(out->locals.size() - 1));
+            }
+        } else if (isSymbol(expr)) {
+            emit(Op::LoadGlobal, global(expr->symbol));
+        } else if (isPrimitive(expr)) {
+            emit(Op::LoadGlobal, global(expr->primitive.name));
+        } else if (isLambda(expr)) {
+            compileLambda(expr->lambda);
+            out->lambdas.push_back(expr->lambda);
+            emit(Op::MakeClosure, static_cast<uint32_t>(out->lambdas.size() - 1));
+        } else if (isList(expr) && !expr->list.empty()) {
+            compileList(expr->list, tail);
+            return; // lists emit their own Return/TailCall in tail position
+        } else if (isNumber(expr)) {
+            emit(Op::PushConst, constant(Value::number(expr->number)));
+        } else if (isList(expr)) {
+            emit(Op::PushConst, constant(Value::nil()));
+        } else {
+            throw std::runtime_error("Invalid expression");
+        }
+        if (tail) {
+            emit(Op::Return);
+        }
+    }
+
+    void compileList(const ExprList& list, bool tail) {
+        ExprPtr first = list[0];
+        if (isKeyword(first, symDefine)) {
+            // (define var expr)
+            if (list.size() != 3 || !(isSymbol(list[1]) || isLocal(list[1]))) {
+                throw std::runtime_error("Invalid define syntax");
+            }
+            compileExpr(list[2], false);
+            if (isLocal(list[1])) {
+                const LocalRef& ref = list[1]->local;
+                emit(Op::StoreLocal, ref.slot, static_cast<uint16_t>(ref.depth));
+            } else {
+                emit(Op::StoreGlobal, list[1]->symbol.id);
+            }
+            if (tail) {
+                emit(Op::Return);
+            }
+        } else if (isKeyword(first, symIf)) {
+            // (if cond then else)
+            if (list.size() != 4) {
+                throw std::runtime_error("Invalid if syntax");
+            }
+            compileExpr(list[1], false);
+            uint32_t toElse = emit(Op::JumpIfFalse);
+            compileExpr(list[2], tail);
+            uint32_t toEnd = tail ? 0 : emit(Op::Jump);
+            out->code[toElse].a = here();
+            compileExpr(list[3], tail);
+            if (!tail) {
+                out->code[toEnd].a = here();
+            }
+        } else if (isPrimitive(first)) {
+            for (size_t i = 1; i < list.size(); ++i) {
+                compileExpr(list[i], false);
+            }
+            emit(first->primitive.op == Primitive::Add ? Op::AddNum : Op::SubNum, static_cast<uint32_t>(list.size() - 1));
+            if (tail) {
+                emit(Op::Return);
+            }
+        } else if (list.size() == 3 && isSymbol(first) && arithFor(first->symbol) != Arith::None) {
+            // (op x y) for a global that is an arithmetic builtin, at least
+            // when the code was compiled
+            compileExpr(list[1], false);
+            compileExpr(list[2], false);
+            emit(Op::CallArith, global(first->symbol), static_cast<uint16_t>(arithFor(first->symbol)));
+            if (tail) {
+                emit(Op::Return);
+            }
+        } else {
+            // Function application
+            for (ExprPtr item : list) {
+                compileExpr(item, false);
+            }
+            emit(tail ? Op::TailCall : Op::Call, static_cast<uint32_t>(list.size() - 1));
+        }
+    }
+
+    void compileLambda(Lambda* lambda) {
+        if (lambda->proto) {
+            return;
+        }
+        program.protos.push_back(std::make_unique<Proto>());
+        Proto* proto = program.protos.back().get();
+        Proto* saved = out;
+        out = proto;
+        lambdas.push_back(lambda);
+        compileExpr(lambda->body, true);
+        lambdas.pop_back();
+        out = saved;
+        lambda->proto = proto;
+    }
+};
+
+std::unique_ptr<Proto> compile(ExprPtr expr, Program& program) {
+    auto proto = Compiler(program).compile(expr);
+    program.account();
+    return proto;
+}
+
+// A stack machine over Protos. Calls between compiled closures push a
+// CallFrame instead of recursing in C++, and TailCall reuses the current one.
+const size_t maxCallDepth = 1 << 20;
+
+class VM : public RootSet {
+public:
+    VM(Heap& owner, ValueStack& stack) : owner(owner), stack(stack) { owner.addRoots(this); }
+    ~VM() { owner.removeRoots(this); }
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+
+    Value run(const Proto& proto, Environment* env);
+
+    void traceRoots(Tracer& tracer) override {
+        for (const CallFrame& frame : frames) {
+            tracer.mark(frame.env);
+            tracer.mark(frame.callee);
+        }
+    }
+
+private:
+    struct CallFrame {
+        const Proto* proto;
+        const Instr* ip;
+        Environment* env;
+        Value callee; // keeps the running function's code alive
+        size_t base;  // stack height below the callee
+    };
+
+    Heap& owner;
+    ValueStack& stack;
+    std::vector<CallFrame> frames;
+
+    // Reads a global through the Proto's cache of its binding cell
+    static const Value& global(const Proto& proto, uint32_t index, Environment* env) {
+        GlobalCache& cache = proto.globals[index];
+        if (cache.owner.load(std::memory_order_acquire) != env->globals) {
+            Value* cell = env->globals->cell(cache.name);
+            if (!cell) {
+                throw std::runtime_error("Undefined symbol: " + symbols().name(cache.name));
+            }
+            cache.cell.store(cell, std::memory_order_relaxed);
+            cache.owner.store(env->globals, std::memory_order_release);
+        }
+        LISP_STAT(EnvGlobalLookups);
+        return *cache.cell.load(std::memory_order_relaxed);
+    }
+
+    // The callee and its arguments must still be on the stack: allocating
+    // the frame may collect
+    Environment* enter(const Function& func, size_t argc) {
+        const Lambda& lambda = *func.lambda;
+        if (argc != lambda.arity) {
+            throw std::runtime_error("Incorrect number of arguments");
+        }
+        Environment* localEnv = Environment::create(func.env, lambda.frameSize);
+        size_t first = stack.size() - argc;
+        for (size_t i = 0; i < argc; ++i) {
+            localEnv->slots()[i] = stack[first + i];
+        }
+        return localEnv;
+    }
+};
+
+#if defined(__GNUC__)
+#define LISP_COMPUTED_GOTO 1
+#else
+#define LISP_COMPUTED_GOTO 0
+#endif
+
+Value VM::run(const Proto& entry, Environment* entryEnv) {
+    EvalDepthGuard depthGuard; // calls between closures stay in this loop; only re-entry nests
+    // Restore the machine on the way out so an error leaves it reusable
+    struct Unwind {
+        VM& vm;
+        size_t stackSize, frameCount;
+        ~Unwind() {
+            vm.stack.truncate(stackSize);
+            vm.frames.resize(frameCount);
+        }
+    } unwind{*this, stack.size(), frames.size()};
+
+    const size_t baseFrame = frames.size();
+    frames.push_back({&entry, entry.code.data(), entryEnv, Value::nil(), stack.size()});
+    const Proto* proto = &entry;
+    const Instr* ip = entry.code.data();
+    Environment* env = entryEnv;
+    Instr in;
+
+#if LISP_COMPUTED_GOTO
+    static void* const labels[] = {
+#define LISP_OPCODE_LABEL(name) &&op_##name,
+        LISP_OPCODES(LISP_OPCODE_LABEL)
+#undef LISP_OPCODE_LABEL
+    };
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() goto *labels[static_cast<size_t>((LISP_STAT(VmInstructions), in = *ip++).op)]
+    VM_NEXT();
+#else
+#define VM_CASE(name) case Op::name:
+#define VM_NEXT() goto dispatch
+dispatch:
+    LISP_STAT(VmInstructions);
+    in = *ip++;
+    switch (in.op) {
+#endif
+
+    // A computed goto does not run destructors for the scope it leaves, so
+    // any local with one lives in an inner block that closes before VM_NEXT.
+    VM_CASE(PushConst) {
+        stack.push(proto->constants[in.a]);
+        VM_NEXT();
+    }
+    VM_CASE(LoadLocal) {
+        stack.push(env->lookup(in.b, in.a));
+        VM_NEXT();
+    }
+    VM_CASE(LoadLocalChecked) {
+        const LocalRef& ref = proto->locals[in.a];
+        const Value& value = env->lookup(ref.depth, ref.slot);
+        if (value.isUndefined()) {
+            throw std::runtime_error("Undefined symbol: " + symbols().name(ref.name));
+        }
+        stack.push(value);
+        VM_NEXT();
+    }
+    VM_CASE(LoadGlobal) {
+        stack.push(global(*proto, in.a, env));
+        VM_NEXT();
+    }
+    VM_CASE(StoreLocal) {
+        env->store(in.b, in.a, stack.back());
+        VM_NEXT();
+    }
+    VM_CASE(StoreGlobal) {
+        env->set(Symbol{in.a}, stack.back());
+        VM_NEXT();
+    }
+    VM_CASE(MakeClosure) {
+        stack.push(Value::object(heap().make<Function>(proto->lambdas[in.a], env)));
+        VM_NEXT();
+    }
+    VM_CASE(Jump) {
+        ip = proto->code.data() + in.a;
+        VM_NEXT();
+    }
+    VM_CASE(JumpIfFalse) {
+        bool truthy;
+        {
+            truthy = stack.pop().isTruthy();
+        }
+        if (!truthy) {
+            ip = proto->code.data() + in.a;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(Call)
+    VM_CASE(TailCall) {
+    do_call:
+        bool returning = false;
+        {
+            size_t argc = in.a;
+            size_t calleeIndex = stack.size() - argc - 1;
+            Value callee = stack[calleeIndex];
+            if (!callee.isFunction()) {
+                throw std::runtime_error("First element is not a function");
+            }
+            Function* func = callee.asFunction();
+
+            if (func->builtin || !func->lambda->proto) {
+                // Builtins, and closures made by the tree-walker, run in C++
+                Value result;
+                if (func->builtin) {
+                    result = func->builtin(stack.args(calleeIndex + 1));
+                } else {
+                    result = eval(func->lambda->body, enter(*func, argc));
+                }
+                stack.truncate(calleeIndex);
+                stack.push(result);
+                returning = in.op == Op::TailCall;
+            } else {
+                Environment* localEnv = enter(*func, argc);
+                if (in.op == Op::TailCall) {
+                    LISP_STAT(VmTailCalls);
+                    // Replace the current frame: drop its stack and environment
+                    CallFrame& frame = frames.back();
+                    stack.truncate(frame.base);
+                    frame.proto = func->lambda->proto;
+                    frame.env = localEnv;
+                    frame.callee = callee;
+                } else {
+                    LISP_STAT(VmCalls);
+                    if (frames.size() - baseFrame >= maxCallDepth) {
+                        throw std::runtime_error("Stack overflow");
+                    }
+                    frames.back().ip = ip;
+                    stack.truncate(calleeIndex);
+                    frames.push_back({func->lambda->proto, nullptr, localEnv, callee, calleeIndex});
+                }
+                proto = frames.back().proto;
+                ip = proto->code.data();
+                env = localEnv;
+            }
+        }
+        if (returning) {
+            goto do_return;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(AddNum)
+    VM_CASE(SubNum) {
+        if (env->globals->primitivesRebound) {
+            // Late binding: slot in whatever the name is bound to now and call it
+            {
+                Symbol name = in.op == Op::AddNum ? symAdd : symSub;
+                Value callee;
+                if (!env->find(name, callee)) {
+                    throw std::runtime_error("Undefined symbol: " + symbols().name(name));
+                }
+                size_t calleeIndex = stack.size() - in.a;
+                stack.push(callee);
+                std::rotate(&stack[calleeIndex], &stack.back(), &stack.back() + 1);
+            }
+            in.op = Op::Call;
+            goto do_call;
+        }
+        {
+            size_t first = stack.size() - in.a;
+            double result;
+            if (in.op == Op::AddNum) {
+                result = 0;
+                for (size_t i = first; i < stack.size(); ++i) {
+                    result += stack[i].asNumber();
+                }
+            } else if (in.a == 1) {
+                result = -stack[first].asNumber();
+            } else {
+                result = stack[first].asNumber();
+                for (size_t i = first + 1; i < stack.size(); ++i) {
+                    result -= stack[i].asNumber();
+                }
+            }
+            stack.truncate(first);
+            stack.push(Value::number(result));
+        }
+        VM_NEXT();
+    }
+    VM_CASE(CallArith) {
+        {
+            const Value& callee = global(*proto, in.a, env);
+            const Value& x = stack[stack.size() - 2];
+            const Value& y = stack.back();
+            if (callee.isFunction() && callee.asFunction()->arith == static_cast<Arith>(in.b) && x.isNumber() &&
+                y.isNumber()) {
+                LISP_STAT(VmArithFast);
+                Value result = applyArith(static_cast<Arith>(in.b), x.asNumber(), y.asNumber());
+                stack.truncate(stack.size() - 2);
+                stack.push(result);
+                VM_NEXT();
+            }
+            // Rebound, or not given numbers: an ordinary call
+            size_t calleeIndex = stack.size() - 2;
+            stack.push(callee);
+            std::rotate(&stack[calleeIndex], &stack.back(), &stack.back() + 1);
+        }
+        in.op = Op::Call;
+        in.a = 2;
+        goto do_call;
+    }
+    VM_CASE(Return) {
+    do_return:
+        {
+            Value result = stack.pop();
+            stack.truncate(frames.back().base);
+            frames.pop_back();
+            if (frames.size() == baseFrame) {
+                return result;
+            }
+            stack.push(result);
+        }
+        proto = frames.back().proto;
+        ip = frames.back().ip;
+        env = frames.back().env;
+        VM_NEXT();
+    }
+
+#if !LISP_COMPUTED_GOTO
+    }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+    throw std::runtime_error("Invalid bytecode");
+}
+
+VM& vm() {
+    return *context.vm;
+}
+
+// Runs a resolved form on either engine (see Engine in lisp.h)
+Value execute(ExprPtr expr, Program& program, Environment* env, Engine engine) {
+    if (engine == Engine::Tree) {
+        return eval(expr, env);
+    }
+    auto proto = compile(expr, program);
+    return vm().run(*proto, env);
+}
+
+// Vector kernels
+// Each kernel is written once over SimdLane, a hardware vector of doubles
+// that supports + and * directly; the loops handle whole lanes and finish
+// the remainder one element at a time. Sums are accumulated lane-wise, so
+// their rounding can differ from a left-to-right loop in the last bits.
+#if LISP_SIMD_AVX2
+using SimdLane = __m256d;
+constexpr size_t simdWidth = 4;
+inline SimdLane simdLoad(const double* p) { return _mm256_loadu_pd(p); }
+inline void simdStore(double* p, SimdLane x) { _mm256_storeu_pd(p, x); }
+inline SimdLane simdSplat(double x) { return _mm256_set1_pd(x); }
+#elif LISP_SIMD_SSE2
+using SimdLane = __m128d;
+constexpr size_t simdWidth = 2;
+inline SimdLane simdLoad(const double* p) { return _mm_loadu_pd(p); }
+inline void simdStore(double* p, SimdLane x) { _mm_storeu_pd(p, x); }
+inline SimdLane simdSplat(double x) { return _mm_set1_pd(x); }
+#elif LISP_SIMD_NEON
+using SimdLane = float64x2_t;
+constexpr size_t simdWidth = 2;
+inline SimdLane simdLoad(const double* p) { return vld1q_f64(p); }
+inline void simdStore(double* p, SimdLane x) { vst1q_f64(p, x); }
+inline SimdLane simdSplat(double x) { return vdupq_n_f64(x); }
+#else
+using SimdLane = double;
+constexpr size_t simdWidth = 1;
+inline SimdLane simdLoad(const double* p) { return *p; }
+inline void simdStore(double* p, SimdLane x) { *p = x; }
+inline SimdLane simdSplat(double x) { return x; }
+#endif
+
+inline double simdTotal(SimdLane x) {
+    double lanes[simdWidth];
+    simdStore(lanes, x);
+    double total = 0;
+    for (double lane : lanes) {
+        total += lane;
+    }
+    return total;
+}
+
+struct AddLanes {
+    template <typename T>
+    T operator()(T x, T y) const { return x + y; }
+};
+
+struct MulLanes {
+    template <typename T>
+    T operator()(T x, T y) const { return x * y; }
+};
+
+// out[i] = op(a[i], b[i]); out may alias either input
+template <typename Op>
+void kernelZip(const double* a, const double* b, double* out, size_t n, Op op) {
+    size_t i = 0;
+    for (; i + simdWidth <= n; i += simdWidth) {
+        simdStore(out + i, op(simdLoad(a + i), simdLoad(b + i)));
+    }
+    for (; i < n; ++i) {
+        out[i] = op(a[i], b[i]);
+    }
+}
+
+// out[i] = op(a[i], s)
+template <typename Op>
+void kernelZipScalar(const double* a, double s, double* out, size_t n, Op op) {
+    SimdLane lanes = simdSplat(s);
+    size_t i = 0;
+    for (; i + simdWidth <= n; i += simdWidth) {
+        simdStore(out + i, op(simdLoad(a + i), lanes));
+    }
+    for (; i < n; ++i) {
+        out[i] = op(a[i], s);
+    }
+}
+
+// Two accumulators, so consecutive additions do not wait on each other
+inline double kernelDot(const double* a, const double* b, size_t n) {
+    SimdLane acc0 = simdSplat(0), acc1 = simdSplat(0);
+    size_t i = 0;
+    for (; i + 2 * simdWidth <= n; i += 2 * simdWidth) {
+        acc0 = acc0 + simdLoad(a + i) * simdLoad(b + i);
+        acc1 = acc1 + simdLoad(a + i + simdWidth) * simdLoad(b + i + simdWidth);
+    }
+    double total = simdTotal(acc0 + acc1);
+    for (; i < n; ++i) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+inline double kernelSum(const double* a, size_t n) {
+    SimdLane acc0 = simdSplat(0), acc1 = simdSplat(0);
+    size_t i = 0;
+    for (; i + 2 * simdWidth <= n; i += 2 * simdWidth) {
+        acc0 = acc0 + simdLoad(a + i);
+        acc1 = acc1 + simdLoad(a + i + simdWidth);
+    }
+    double total = simdTotal(acc0 + acc1);
+    for (; i < n; ++i) {
+        total += a[i];
+    }
+    return total;
+}
+
+// Calls a function from C++ with arguments that stay rooted, such as a
+// builtin's own, and returns its result
+Value apply(const Value& callee, Args args) {
+    if (!callee.isFunction()) {
+        throw std::runtime_error("First element is not a function");
+    }
+    Function& func = *callee.asFunction();
+    if (func.arith != Arith::None && args.size() == 2 && args[0].isNumber() && args[1].isNumber()) {
+        return applyArith(func.arith, args[0].asNumber(), args[1].asNumber());
+    }
+    if (func.builtin) {
+        return func.builtin(args);
+    }
+    const Lambda& lambda = *func.lambda;
+    if (args.size() != lambda.arity) {
+        throw std::runtime_error("Incorrect number of arguments");
+    }
+    Environment* localEnv = Environment::create(func.env, lambda.frameSize);
+    std::copy(args.begin(), args.end(), localEnv->slots());
+    if (lambda.proto) {
+        return vm().run(*lambda.proto, localEnv);
+    }
+    return eval(lambda.body, localEnv);
+}
+
+// Memoized functions
+// A memoized function is a builtin made at run time around its table. The
+// table is looked up before the call and filled in after it, never held
+// across it, so the calls the target makes may use and evict entries
+// freely; recursion through the memoized global is what makes them hit.
+// A parallel call's worker reads the caller's table, which is frozen, and
+// keeps what it computes in a scratch table of its own for the rest of the
+// call, so memoized recursion on a worker is linear too.
+uint64_t memoBits(const Value& arg) {
+    double num = arg.asNumber();
+    uint64_t bits;
+    std::memcpy(&bits, &num, sizeof bits);
+    return bits;
+}
+
+// The entry for args, which hash to `hash`, moved to the front if `touch`
+bool memoLookup(Memo& memo, uint64_t hash, Args args, bool touch, Value& result) {
+    auto it = memo.index.find(hash);
+    if (it == memo.index.end()) {
+        return false;
+    }
+    Memo::Entry& entry = *it->second;
+    if (entry.args.size() != args.size() ||
+        !std::equal(args.begin(), args.end(), entry.args.begin(),
+                    [](const Value& arg, uint64_t bits) { return memoBits(arg) == bits; })) {
+        return false;
+    }
+    if (touch) {
+        memo.entries.splice(memo.entries.begin(), memo.entries, it->second);
+    }
+    result = entry.result;
+    return true;
+}
+
+// On the heap that owns the table
+void memoStore(Memo& memo, uint64_t hash, Args args, Value result) {
+    auto erase = [&](std::list<Memo::Entry>::iterator entry) {
+        memo.entryBytes -= sizeof(Memo::Entry) + 4 * sizeof(void*) + entry->args.size() * sizeof(uint64_t);
+        memo.index.erase(entry->hash);
+        memo.entries.erase(entry);
+    };
+    // The call may have added an entry under the same hash, or a colliding one
+    auto found = memo.index.find(hash);
+    if (found != memo.index.end()) {
+        erase(found->second);
+    }
+    std::vector<uint64_t> key;
+    key.reserve(args.size());
+    for (const Value& arg : args) {
+        key.push_back(memoBits(arg));
+    }
+    memo.entries.push_front({hash, std::move(key), result});
+    memo.index[hash] = memo.entries.begin();
+    memo.entryBytes += sizeof(Memo::Entry) + 4 * sizeof(void*) + args.size() * sizeof(uint64_t);
+    heap().writeBarrier(&memo, result);
+    if (memo.entries.size() > memo.capacity) {
+        LISP_STAT(MemoEvictions);
+        erase(std::prev(memo.entries.end()));
+    }
+    heap().resize(&memo, sizeof(Memo) + memo.entryBytes);
+}
+
+// This worker's table for memo, made on first use
+Memo* scratchMemo(const Memo& memo) {
+    if (!context.scratch) {
+        return nullptr;
+    }
+    auto it = context.scratch->find(&memo);
+    if (it != context.scratch->end()) {
+        return it->second;
+    }
+    Memo* table = heap().make<Memo>(memo.target, memo.capacity); // the target is the caller's, and frozen
+    context.scratch->emplace(&memo, table);
+    return table;
+}
+
+Value callMemo(Memo& memo, Args args) {
+    bool cacheable = true;
+    uint64_t hash = 14695981039346656037ull;
+    for (const Value& arg : args) {
+        cacheable = cacheable && arg.isNumber();
+        hash = cacheable ? (hash ^ memoBits(arg)) * 1099511628211ull : hash;
+    }
+    if (!cacheable) {
+        LISP_STAT(MemoMisses);
+        return apply(memo.target, args);
+    }
+    hash ^= hash >> 32;
+    bool owned = &heap() == memo.owner;
+    Memo* scratch = owned ? nullptr : scratchMemo(memo);
+    Value result;
+    if (memoLookup(memo, hash, args, owned, result) || (scratch && memoLookup(*scratch, hash, args, true, result))) {
+        LISP_STAT(MemoHits);
+        return result;
+    }
+
+    LISP_STAT(MemoMisses);
+    result = apply(memo.target, args);
+    if (owned || scratch) {
+        memoStore(owned ? memo : *scratch, hash, args, result);
+    }
+    return result;
+}
+
+// May collect; `target` need not be rooted
+Value makeMemo(Value target, size_t capacity) {
+    LocalRoot targetRoot(target);
+    Value table = Value::object(heap().make<Memo>(target, capacity));
+    LocalRoot tableRoot(table);
+    Memo* memo = static_cast<Memo*>(table.asObject());
+    Function* func = heap().make<Function>([memo](Args args) { return callMemo(*memo, args); });
+    func->state = memo;
+    heap().writeBarrier(func, table);
+    return Value::object(func);
+}
+
+Memo* memoOf(const Value& value) {
+    if (!value.isFunction() || !value.asFunction()->state || value.asFunction()->state->type != ObjectType::Memo) {
+        return nullptr;
+    }
+    return static_cast<Memo*>(value.asFunction()->state);
+}
+
+// Built-in Functions
+// With stats compiled in, every call to a builtin is counted and timed
+// under its name
+void defineBuiltin(Environment* env, const char* name, BuiltinFunc func, Arith arith = Arith::None) {
+#if LISP_STATS
+    CallStat& stat = StatRegistry::registry().call(name);
+    func = [&stat, inner = std::move(func)](Args args) {
+        struct Timing {
+            CallStat& stat;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            ~Timing() {
+                stat.calls.fetch_add(1, std::memory_order_relaxed);
+                stat.ns.fetch_add(StatTimer::elapsedNs(start), std::memory_order_relaxed);
+            }
+        } timing{stat};
+        return inner(args);
+    };
+#endif
+    Function* builtin = heap().make<Function>(std::move(func));
+    builtin->arith = arith;
+    env->set(intern(name), Value::object(builtin));
+}
+
+// (op a b c ...) is 1 if op holds between each pair of neighbours, else 0
+Value compareChain(Args args, const char* name, Arith op) {
+    if (args.size() < 2) {
+        throw std::runtime_error(std::string("'") + name + "' requires at least two arguments");
+    }
+    bool holds = true;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (!args[i].isNumber()) {
+            throw std::runtime_error(std::string("Arguments to '") + name + "' must be numbers");
+        }
+        holds = holds && (i == 0 || applyArith(op, args[i - 1].asNumber(), args[i].asNumber()).isTruthy());
+    }
+    return Value::number(holds ? 1 : 0);
+}
+
+// The vector arguments of a builtin taking exactly N of them
+template <size_t N>
+std::array<Vector*, N> vectorArgs(Args args, const char* name) {
+    std::array<Vector*, N> vectors;
+    if (args.size() != N) {
+        throw std::runtime_error(std::string("'") + name + "' takes " + std::to_string(N) + " vectors");
+    }
+    for (size_t i = 0; i < N; ++i) {
+        if (!args[i].isVector()) {
+            throw std::runtime_error(std::string("Arguments to '") + name + "' must be vectors");
+        }
+        vectors[i] = args[i].asVector();
+    }
+    return vectors;
+}
+
+size_t vectorLength(const Value& length, const char* name) {
+    double n = length.isNumber() ? length.asNumber() : -1;
+    if (!(n >= 0 && n <= maxVectorLength) || n != static_cast<size_t>(n)) {
+        throw std::runtime_error(std::string("Invalid length for '") + name + "'");
+    }
+    return static_cast<size_t>(n);
+}
+
+Pair* pairArg(Args args, const char* name) {
+    if (args.size() != 1 || !args[0].isPair()) {
+        throw std::runtime_error(std::string("'") + name + "' takes a pair");
+    }
+    return args[0].asPair();
+}
+
+// Visits each element of a proper list. The list must stay rooted, which
+// it does when it is an argument, since nothing can change its pairs.
+template <typename Visit>
+void forEachElement(const Value& list, const char* name, Visit visit) {
+    Value rest = list;
+    for (; rest.isPair(); rest = rest.asPair()->cdr) {
+        visit(rest.asPair()->car);
+    }
+    if (!rest.isNil()) {
+        throw std::runtime_error(std::string("'") + name + "' takes a list");
+    }
+}
+
+// Builds a list front to back in a single pass; the head is rooted, and
+// with it every pair appended so far
+struct ListBuilder {
+    Value head = Value::nil();
+    Pair* tail = nullptr;
+    LocalRoot headRoot{head};
+
+    // May collect
+    void append(Value value) {
+        LocalRoot valueRoot(value);
+        Pair* pair = Pair::create(value, Value::nil());
+        if (tail) {
+            tail->cdr = Value::object(pair);
+            heap().writeBarrier(tail, tail->cdr);
+        } else {
+            head = Value::object(pair);
+        }
+        tail = pair;
+    }
+};
+
+// Parallel calls
+// pmap and preduce apply one function to many items on a pool shared by
+// every instance. A worker may not allocate on the caller's heap, so the
+// items are split into chunks run on workers with a heap, stack and VM of
+// their own. A worker is made only for a pool thread that finds none idle
+// and then runs chunk after chunk, as its stack alone reserves 8 MB. The
+// caller's heap and globals are frozen meanwhile: its objects, the
+// closure's captured environments included, look permanent to the
+// workers' collectors and nothing writes to them. A worker's frames can
+// then point into the caller's heap. Once every chunk is done, the results
+// still on the workers' heaps are copied onto the caller's, and the
+// workers are freed. The function must not define globals; nothing else it
+// could do writes to an object it did not make.
+ThreadPool& parallelPool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+class ParallelCall {
+public:
+    explicit ParallelCall(Globals& globals) : caller(heap()), globals(globals) {
+        // Thawed in reverse whatever happens next, even if freezing throws part way
+        caller.freeze();
+        try {
+            globals.freeze();
+        } catch (...) {
+            caller.thaw();
+            throw;
+        }
+    }
+
+    ~ParallelCall() {
+        globals.thaw();
+        caller.thaw();
+    }
+
+    ParallelCall(const ParallelCall&) = delete;
+    ParallelCall& operator=(const ParallelCall&) = delete;
+
+    // Splits [0, count) into chunks and runs body(first, last, results) for
+    // each, where results collects the chunk's values, on whichever worker
+    // is idle
+    template <typename Body>
+    void run(size_t count, Body body) {
+        size_t chunks = std::min(count, (parallelPool().size() + 1) * 4);
+        workers.clear();
+        idle.clear();
+        results.assign(chunks, {});
+        std::ostream* out = context.out; // the chunks run on pool threads, with contexts of their own
+        parallelPool().parallelFor(chunks, [&](size_t chunk) {
+            Lease lease(*this);
+            Worker& worker = lease.worker;
+            worker.held.push_back(&results[chunk]);
+            ContextScope scope({&worker.memory, &worker.stack, &worker.machine, &globals, out, &worker.scratch});
+            body(count * chunk / chunks, count * (chunk + 1) / chunks, results[chunk]);
+        });
+    }
+
+    // Calls visit(value) on each result in order, copied onto the caller's
+    // heap, which does not collect while frozen
+    template <typename Visit>
+    void forEachResult(Visit visit) {
+        for (const auto& chunk : results) {
+            for (const Value& result : chunk) {
+                visit(adopt(result));
+            }
+        }
+    }
+
+private:
+    struct Worker : RootSet {
+        Heap memory;
+        ValueStack stack{memory, 1 << 20};
+        VM machine{memory, stack};
+        std::vector<const std::vector<Value>*> held; // results of the chunks run here, which live on this heap
+        std::unordered_map<const Memo*, Memo*> scratch; // tables for the caller's memoized functions
+
+        explicit Worker(const Heap& caller) {
+            memory.nurserySize = caller.nurserySize;
+            memory.addRoots(this);
+        }
+        ~Worker() { memory.removeRoots(this); }
+
+        void traceRoots(Tracer& tracer) override {
+            for (const std::vector<Value>* chunk : held) {
+                for (const Value& value : *chunk) {
+                    tracer.mark(value);
+                }
+            }
+            for (const auto& table : scratch) {
+                tracer.mark(Value::object(table.second));
+            }
+        }
+    };
+
+    // An idle worker, or a new one, for the length of a chunk
+    struct Lease {
+        ParallelCall& call;
+        Worker& worker;
+
+        explicit Lease(ParallelCall& call) : call(call), worker(call.acquire()) {}
+        ~Lease() {
+            std::lock_guard<std::mutex> lock(call.mutex);
+            call.idle.push_back(&worker);
+        }
+    };
+
+    Heap& caller;
+    Globals& globals;
+    std::mutex mutex; // guards workers and idle while chunks run
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<Worker*> idle;
+    std::vector<std::vector<Value>> results; // by chunk
+    std::unordered_map<Object*, Object*> copies; // worker object to its copy, so sharing and cycles survive
+    std::vector<Object*> pending;                 // worker objects whose copies have yet to be filled in
+
+    Worker& acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.empty()) {
+            workers.push_back(std::make_unique<Worker>(caller));
+            return *workers.back();
+        }
+        Worker* worker = idle.back();
+        idle.pop_back();
+        return *worker;
+    }
+
+    // While the caller is frozen its objects, and the builtins, are marked;
+    // a worker's objects are not, outside of the worker's collections. Deep
+    // results are copied without recursing: each object reached gets an
+    // empty copy, and its fields are filled in when it is taken off the
+    // worklist.
+    Value adopt(const Value& value) {
+        Value copy = copyOf(value);
+        while (!pending.empty()) {
+            Object* obj = pending.back();
+            pending.pop_back();
+            fill(obj, copies[obj]);
+        }
+        return copy;
+    }
+
+    Value copyOf(const Value& value) {
+        if (!value.isObject() || value.asObject()->marked) {
+            return value;
+        }
+        Object* obj = value.asObject();
+        auto it = copies.find(obj);
+        if (it != copies.end()) {
+            return Value::object(it->second);
+        }
+        Object* copy = nullptr;
+        switch (obj->type) {
+        case ObjectType::Pair:
+            copy = Pair::create(Value::nil(), Value::nil());
+            break;
+        case ObjectType::Vector: {
+            const Vector& vector = *value.asVector();
+            Vector* numbers = Vector::create(vector.length);
+            std::copy(vector.data(), vector.data() + vector.length, numbers->data());
+            copies[obj] = numbers;
+            return Value::object(numbers);
+        }
+        case ObjectType::Function:
+            // Workers make closures and memoized functions, whose copies start
+            // with empty tables; other builtins are permanent
+            if (Memo* memo = memoOf(value)) {
+                copy = makeMemo(Value::nil(), memo->capacity).asObject();
+            } else {
+                copy = caller.make<Function>(value.asFunction()->lambda, nullptr);
+            }
+            break;
+        case ObjectType::Environment: {
+            Environment& env = *value.asEnvironment();
+            copy = caller.makeWithExtra<Environment>(env.slotCount * sizeof(Value), nullptr, env.globals,
+                                                     env.slotCount);
+            break;
+        }
+        case ObjectType::Program:
+        case ObjectType::Memo:
+            throw std::runtime_error("Invalid parallel result");
+        }
+        copies[obj] = copy;
+        pending.push_back(obj);
+        return Value::object(copy);
+    }
+
+    void fill(Object* obj, Object* copy) {
+        Value original = Value::object(obj);
+        switch (obj->type) {
+        case ObjectType::Pair: {
+            Pair* pair = static_cast<Pair*>(copy);
+            pair->car = copyOf(original.asPair()->car);
+            pair->cdr = copyOf(original.asPair()->cdr);
+            break;
+        }
+        case ObjectType::Function:
+            if (Memo* memo = memoOf(original)) {
+                Memo& table = *memoOf(Value::object(copy));
+                table.target = copyOf(memo->target);
+                caller.writeBarrier(&table, table.target);
+            } else {
+                static_cast<Function*>(copy)->env = copyOf(Value::object(original.asFunction()->env)).asEnvironment();
+            }
+            break;
+        case ObjectType::Environment: {
+            Environment& env = *original.asEnvironment();
+            Environment* frame = static_cast<Environment*>(copy);
+            frame->outer = env.outer ? copyOf(Value::object(env.outer)).asEnvironment() : nullptr;
+            for (uint32_t i = 0; i < env.slotCount; ++i) {
+                frame->slots()[i] = copyOf(env.slots()[i]);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+};
+
+template <typename Op>
+Value zip(Args args, const char* name, Op op) {
+    if (args.size() != 2 || !(args[0].isVector() || args[1].isVector()) ||
+        !(args[0].isVector() || args[0].isNumber()) || !(args[1].isVector() || args[1].isNumber())) {
+        throw std::runtime_error(std::string("'") + name + "' takes two vectors, or a vector and a number");
+    }
+    size_t length = (args[0].isVector() ? args[0] : args[1]).asVector()->length;
+    if (args[0].isVector() && args[1].isVector() && args[1].asVector()->length != length) {
+        throw std::runtime_error(std::string("Arguments to '") + name + "' must have the same length");
+    }
+    Vector* result = Vector::create(length); // the arguments stay rooted on the stack
+    if (args[0].isVector() && args[1].isVector()) {
+        kernelZip(args[0].asVector()->data(), args[1].asVector()->data(), result->data(), length, op);
+    } else {
+        bool first = args[0].isVector();
+        kernelZipScalar((first ? args[0] : args[1]).asVector()->data(), (first ? args[1] : args[0]).asNumber(),
+                        result->data(), length, op);
+    }
+    return Value::object(result);
+}
+
+void addBuiltins(Environment* env) {
+    defineBuiltin(env, "+", [](Args args) {
+        double sum = 0;
+        for (auto& arg : args) {
+            if (!arg.isNumber()) {
+                throw std::runtime_error("Arguments to '+' must be numbers");
+            }
+            sum += arg.asNumber();
+        }
+        return Value::number(sum);
+    }, Arith::Add);
+
+    defineBuiltin(env, "-", [](Args args) {
+        if (args.empty()) {
+            throw std::runtime_error("'-' requires at least one argument");
+        }
+        if (!args[0].isNumber()) {
+            throw std::runtime_error("Arguments to '-' must be numbers");
+        }
+        double result = args[0].asNumber();
+        if (args.size() == 1) {
+            return Value::number(-result);
+        }
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (!args[i].isNumber()) {
+                throw std::runtime_error("Arguments to '-' must be numbers");
+            }
+            result -= args[i].asNumber();
+        }
+        return Value::number(result);
+    }, Arith::Sub);
+
+    defineBuiltin(env, "*", [](Args args) {
+        double product = 1;
+        for (auto& arg : args) {
+            if (!arg.isNumber()) {
+                throw std::runtime_error("Arguments to '*' must be numbers");
+            }
+            product *= arg.asNumber();
+        }
+        return Value::number(product);
+    }, Arith::Mul);
+
+    // (< a b c ...) is 1 if the arguments are strictly increasing, else 0
+    defineBuiltin(env, "<", [](Args args) { return compareChain(args, "<", Arith::Less); }, Arith::Less);
+
+    defineBuiltin(env, "/", [](Args args) {
+        if (args.empty()) {
+            throw std::runtime_error("'/' requires at least one argument");
+        }
+        for (auto& arg : args) {
+            if (!arg.isNumber()) {
+                throw std::runtime_error("Arguments to '/' must be numbers");
+            }
+        }
+        double result = args[0].asNumber();
+        if (args.size() == 1) {
+            return Value::number(1 / result);
+        }
+        for (size_t i = 1; i < args.size(); ++i) {
+            result /= args[i].asNumber();
+        }
+        return Value::number(result);
+    }, Arith::Div);
+
+    defineBuiltin(env, ">", [](Args args) { return compareChain(args, ">", Arith::Greater); }, Arith::Greater);
+    defineBuiltin(env, "==", [](Args args) { return compareChain(args, "==", Arith::Equal); }, Arith::Equal);
+
+    // Packed vectors
+    defineBuiltin(env, "vec", [](Args args) {
+        for (auto& arg : args) {
+            if (!arg.isNumber()) {
+                throw std::runtime_error("Arguments to 'vec' must be numbers");
+            }
+        }
+        Vector* result = Vector::create(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            result->data()[i] = args[i].asNumber();
+        }
+        return Value::object(result);
+    });
+
+    // (make-vec n x) is n copies of x
+    defineBuiltin(env, "make-vec", [](Args args) {
+        if (args.size() != 2 || !args[1].isNumber()) {
+            throw std::runtime_error("'make-vec' takes a length and a number");
+        }
+        Vector* result = Vector::create(vectorLength(args[0], "make-vec"));
+        std::fill(result->data(), result->data() + result->length, args[1].asNumber());
+        return Value::object(result);
+    });
+
+    // (vec-range n) is 0, 1, ..., n - 1
+    defineBuiltin(env, "vec-range", [](Args args) {
+        if (args.size() != 1) {
+            throw std::runtime_error("'vec-range' takes a length");
+        }
+        Vector* result = Vector::create(vectorLength(args[0], "vec-range"));
+        for (size_t i = 0; i < result->length; ++i) {
+            result->data()[i] = static_cast<double>(i);
+        }
+        return Value::object(result);
+    });
+
+    defineBuiltin(env, "vec-len", [](Args args) {
+        return Value::number(static_cast<double>(vectorArgs<1>(args, "vec-len")[0]->length));
+    });
+
+    defineBuiltin(env, "vec-ref", [](Args args) {
+        if (args.size() != 2 || !args[0].isVector() || !args[1].isNumber()) {
+            throw std::runtime_error("'vec-ref' takes a vector and an index");
+        }
+        Vector& vector = *args[0].asVector();
+        double index = args[1].asNumber();
+        if (!(index >= 0 && index < static_cast<double>(vector.length)) || index != static_cast<size_t>(index)) {
+            throw std::runtime_error("Index out of range");
+        }
+        return Value::number(vector.data()[static_cast<size_t>(index)]);
+    });
+
+    // (vec-add a b) and (vec-mul a b) work element-wise on two vectors of
+    // the same length, or on a vector and a number
+    defineBuiltin(env, "vec-add", [](Args args) { return zip(args, "vec-add", AddLanes()); });
+    defineBuiltin(env, "vec-mul", [](Args args) { return zip(args, "vec-mul", MulLanes()); });
+
+    defineBuiltin(env, "dot", [](Args args) {
+        std::array<Vector*, 2> vectors = vectorArgs<2>(args, "dot");
+        if (vectors[0]->length != vectors[1]->length) {
+            throw std::runtime_error("Arguments to 'dot' must have the same length");
+        }
+        return Value::number(kernelDot(vectors[0]->data(), vectors[1]->data(), vectors[0]->length));
+    });
+
+    defineBuiltin(env, "sum", [](Args args) {
+        Vector* vector = vectorArgs<1>(args, "sum")[0];
+        return Value::number(kernelSum(vector->data(), vector->length));
+    });
+
+    // (map-num f v) is the vector of (f x) for each element x of v
+    defineBuiltin(env, "map-num", [](Args args) {
+        if (args.size() != 2 || !args[0].isFunction() || !args[1].isVector()) {
+            throw std::runtime_error("'map-num' takes a function and a vector");
+        }
+        Value result = Value::object(Vector::create(args[1].asVector()->length));
+        LocalRoot resultRoot(result);
+        for (size_t i = 0; i < result.asVector()->length; ++i) {
+            Value x = Value::number(args[1].asVector()->data()[i]);
+            Value y = apply(args[0], Args{&x, 1});
+            if (!y.isNumber()) {
+                throw std::runtime_error("'map-num' function must return numbers");
+            }
+            result.asVector()->data()[i] = y.asNumber();
+        }
+        return result;
+    });
+
+    defineBuiltin(env, "cons", [](Args args) {
+        if (args.size() != 2) {
+            throw std::runtime_error("'cons' takes two arguments");
+        }
+        return Value::object(Pair::create(args[0], args[1]));
+    });
+
+    defineBuiltin(env, "car", [](Args args) {
+        return pairArg(args, "car")->car;
+    });
+
+    defineBuiltin(env, "cdr", [](Args args) {
+        return pairArg(args, "cdr")->cdr;
+    });
+
+    // Built back to front, so each pair is made once and never patched
+    defineBuiltin(env, "list", [](Args args) {
+        Value result = Value::nil();
+        LocalRoot resultRoot(result);
+        for (size_t i = args.size(); i > 0; --i) {
+            result = Value::object(Pair::create(args[i - 1], result));
+        }
+        return result;
+    });
+
+    defineBuiltin(env, "null?", [](Args args) {
+        if (args.size() != 1) {
+            throw std::runtime_error("'null?' takes one argument");
+        }
+        return Value::number(args[0].isNil() ? 1 : 0);
+    });
+
+    defineBuiltin(env, "pair?", [](Args args) {
+        if (args.size() != 1) {
+            throw std::runtime_error("'pair?' takes one argument");
+        }
+        return Value::number(args[0].isPair() ? 1 : 0);
+    });
+
+    defineBuiltin(env, "length", [](Args args) {
+        if (args.size() != 1) {
+            throw std::runtime_error("'length' takes one argument");
+        }
+        size_t length = 0;
+        forEachElement(args[0], "length", [&](const Value&) { ++length; });
+        return Value::number(static_cast<double>(length));
+    });
+
+    // (map f l) is the list of (f x) for each element x of l
+    defineBuiltin(env, "map", [](Args args) {
+        if (args.size() != 2 || !args[0].isFunction()) {
+            throw std::runtime_error("'map' takes a function and a list");
+        }
+        ListBuilder result;
+        forEachElement(args[1], "map", [&](const Value& x) { result.append(apply(args[0], Args{&x, 1})); });
+        return result.head;
+    });
+
+    // (filter f l) is the list of the elements x of l for which (f x) is true
+    defineBuiltin(env, "filter", [](Args args) {
+        if (args.size() != 2 || !args[0].isFunction()) {
+            throw std::runtime_error("'filter' takes a function and a list");
+        }
+        ListBuilder result;
+        forEachElement(args[1], "filter", [&](const Value& x) {
+            if (apply(args[0], Args{&x, 1}).isTruthy()) {
+                result.append(x);
+            }
+        });
+        return result.head;
+    });
+
+    // (reduce f init l) folds from the left: (f (f init x1) x2) and so on
+    defineBuiltin(env, "reduce", [](Args args) {
+        if (args.size() != 3 || !args[0].isFunction()) {
+            throw std::runtime_error("'reduce' takes a function, an initial value and a list");
+        }
+        Value acc = args[1];
+        LocalRoot accRoot(acc);
+        forEachElement(args[2], "reduce", [&](const Value& x) {
+            Value pair[2] = {acc, x};
+            acc = apply(args[0], Args{pair, 2});
+        });
+        return acc;
+    });
+
+    // (pmap f l) is (map f l) with the calls spread over the pool
+    defineBuiltin(env, "pmap", [](Args args) {
+        if (args.size() != 2 || !args[0].isFunction()) {
+            throw std::runtime_error("'pmap' takes a function and a list");
+        }
+        std::vector<Value> items; // the list stays rooted, and frozen, as an argument
+        forEachElement(args[1], "pmap", [&](const Value& x) { items.push_back(x); });
+        ListBuilder result;
+        ParallelCall call(*context.globals);
+        call.run(items.size(), [&](size_t first, size_t last, std::vector<Value>& results) {
+            for (size_t i = first; i < last; ++i) {
+                results.push_back(apply(args[0], Args{&items[i], 1}));
+            }
+        });
+        call.forEachResult([&](const Value& y) { result.append(y); });
+        return result.head;
+    });
+
+    // (preduce f init l) is (reduce f init l) for an associative f: each
+    // chunk of l is folded on the pool, then init and the chunks' values are
+    // folded in order
+    defineBuiltin(env, "preduce", [](Args args) {
+        if (args.size() != 3 || !args[0].isFunction()) {
+            throw std::runtime_error("'preduce' takes a function, an initial value and a list");
+        }
+        std::vector<Value> items;
+        forEachElement(args[2], "preduce", [&](const Value& x) { items.push_back(x); });
+        ValueStack& stack = valueStack();
+        StackMark mark(stack);
+        {
+            ParallelCall call(*context.globals);
+            call.run(items.size(), [&](size_t first, size_t last, std::vector<Value>& results) {
+                Value acc = items[first];
+                LocalRoot accRoot(acc); // on the worker's heap
+                for (size_t i = first + 1; i < last; ++i) {
+                    Value pair[2] = {acc, items[i]};
+                    acc = apply(args[0], Args{pair, 2});
+                }
+                results.push_back(acc);
+            });
+            call.forEachResult([&](const Value& value) { stack.push(value); });
+        }
+        Value acc = args[1];
+        LocalRoot accRoot(acc);
+        for (size_t i = mark.height; i < stack.size(); ++i) {
+            Value pair[2] = {acc, stack[i]};
+            acc = apply(args[0], Args{pair, 2});
+        }
+        return acc;
+    });
+
+    // (memoize f) is f remembering its results for calls whose arguments
+    // are all numbers, the 4096 most recently used of them; (memoize f n)
+    // keeps n. (define-memo name f) is (define name (memoize f)).
+    defineBuiltin(env, "memoize", [](Args args) {
+        if (args.empty() || args.size() > 2 || !args[0].isFunction() ||
+            (args.size() == 2 && !(args[1].isNumber() && args[1].asNumber() >= 1 && args[1].asNumber() <= UINT32_MAX))) {
+            throw std::runtime_error("'memoize' takes a function and an optional capacity of at least 1");
+        }
+        return makeMemo(args[0], args.size() == 2 ? static_cast<size_t>(args[1].asNumber()) : defaultMemoCapacity);
+    });
+
+    // (stats) prints the profiling counters gathered so far
+    defineBuiltin(env, "stats", [](Args) {
+        printStats(*context.out);
+        return Value::nil();
+    });
+}
+
+// Script files
+// The whole file is mapped read-only where mmap is available and read into
+// memory otherwise. Nothing parsed from it refers back to the text, so the
+// mapping only needs to outlive parsing. A writable mapping is private, so
+// writes to it never reach the file.
+class SourceFile {
+public:
+    explicit SourceFile(const char* path, bool writable = false) {
+#if LISP_HAVE_MMAP
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Cannot open ") + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error(std::string("Cannot read ") + path);
+        }
+        size = static_cast<size_t>(info.st_size);
+        if (size > 0) {
+            void* mapping = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(std::string("Cannot map ") + path);
+            }
+            data = static_cast<char*>(mapping);
+        }
+        close(fd);
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error(std::string("Cannot open ") + path);
+        }
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = contents.data();
+        size = contents.size();
+#endif
+    }
+
+    ~SourceFile() {
+#if LISP_HAVE_MMAP
+        if (data) {
+            munmap(data, size);
+        }
+#endif
+    }
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    std::string_view text() const { return {data, size}; }
+    char* bytes() { return data; }
+
+private:
+    char* data = nullptr;
+    size_t size = 0;
+#if !LISP_HAVE_MMAP
+    std::string contents;
+#endif
+};
+
+// Peak resident set size of the process so far, or 0 where unknown
+size_t peakRssKb() {
+#if LISP_HAVE_RUSAGE
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+        return static_cast<size_t>(usage.ru_maxrss) / 1024; // bytes there
+#else
+        return static_cast<size_t>(usage.ru_maxrss);
+#endif
+    }
+#endif
+    return 0;
+}
+
+// Lists print as (1 2 3), or as (1 2 . 3) when they do not end in nil
+void printValue(std::ostream& out, const Value& value) {
+    if (value.isNumber()) {
+        out << value.asNumber();
+    } else if (value.isFunction()) {
+        out << "<function>";
+    } else if (value.isVector()) {
+        const Vector& vector = *value.asVector();
+        out << "#(";
+        for (size_t i = 0; i < vector.length; ++i) {
+            out << (i ? " " : "") << vector.data()[i];
+        }
+        out << ")";
+    } else if (value.isNil() || value.isPair()) {
+        out << "(";
+        Value rest = value;
+        for (bool first = true; rest.isPair(); rest = rest.asPair()->cdr, first = false) {
+            out << (first ? "" : " ");
+            printValue(out, rest.asPair()->car);
+        }
+        if (!rest.isNil()) {
+            out << " . ";
+            printValue(out, rest);
+        }
+        out << ")";
+    } else {
+        out << "<unknown>";
+    }
+}
+
+void printResult(const Value& result) {
+    printValue(*context.out, result);
+    *context.out << "\n";
+}
+
+// Images
+// An image holds everything a session's globals reach: closures and their
+// environments, lists and vectors, and the AST and bytecode of every lambda
+// they can run. Loading one runs no parser, resolver, compiler or script.
+// The AST section is laid out just as the nodes sit in memory, with offsets
+// in place of pointers and image symbol numbers in place of ids. The file
+// is mapped privately and one pass over the fixup tables turns it into
+// live nodes where they lie. Bytecode arrays are copied out whole, and only
+// the heap objects, which the collector must own, are built one by one.
+// Builtins are saved by name.
+// The layout is that of this build, so an image is refused by a build whose
+// nodes differ. Images are trusted like the scripts they came from: their
+// structure is checked, not every operand of their code.
+//
+// Layout: ImageHeader, then the AST section, then the data section:
+//   symbols     count, then each name as a length and its bytes
+//   fixups      count and AST offsets of pointers, then of symbols
+//   lambdas     count, then each one's AST offset and proto number
+//   protos      count, then each one's code, constants, lambdas, locals
+//               and global names
+//   objects     count, then each one's kind and contents; a memoized
+//               function keeps its target and capacity, not its results
+//   globals     count, then each binding's symbol and value
+// Values inside objects and globals keep their bits, except that an object
+// reference carries its object number in place of the pointer.
+struct ImageHeader {
+    char magic[8];
+    uint64_t layout;
+    uint64_t astOffset, astSize;
+    uint64_t dataOffset, dataSize;
+};
+
+constexpr char imageMagic[8] = {'L', 'I', 'S', 'P', 'I', 'M', 'G', '1'};
+
+// Changes whenever the structs the AST section copies do
+constexpr uint64_t imageLayout() {
+    uint64_t hash = 14695981039346656037ull;
+    for (uint64_t part : {sizeof(void*), sizeof(Symbol), sizeof(Expression), alignof(Expression),
+                          offsetof(Expression, kind), offsetof(Expression, number), offsetof(Expression, list),
+                          sizeof(ExprList), offsetof(ExprList, items), offsetof(ExprList, count), sizeof(LocalRef),
+                          sizeof(PrimitiveRef), sizeof(Lambda), offsetof(Lambda, params), offsetof(Lambda, body),
+                          offsetof(Lambda, program), offsetof(Lambda, proto), sizeof(Instr),
+                          static_cast<uint64_t>(Op::Return), uint64_t{0x01020304}}) {
+        hash = (hash ^ part) * 1099511628211ull;
+    }
+    return hash;
+}
+
+enum class ImageObject : uint8_t {
+    Pair,
+    Vector,
+    Environment,
+    Closure,
+    Builtin,
+    Root, // the slotless environment of the globals
+    Memo, // saved without its table
+};
+
+class ImageWriter {
+public:
+    explicit ImageWriter(const Globals& globals) : globals(globals) {
+        if (globals.base) {
+            for (const auto& entry : globals.base->vars) {
+                if (entry.second.isObject()) {
+                    builtinNames[entry.second.asObject()] = entry.first;
+                }
+            }
+        }
+        for (const auto& entry : globals.vars) {
+            // Bindings still holding their builtin were only copied in by a cache
+            const Value* inherited = globals.base ? globals.base->find(entry.first) : nullptr;
+            if (!inherited || !same(*inherited, entry.second)) {
+                bindings.push_back(entry);
+                visit(entry.second);
+            }
+        }
+        while (!pendingObjects.empty() || !pendingExprs.empty() || !pendingProtos.empty()) {
+            drain();
+        }
+    }
+
+    void write(const char* path) {
+        // Everything after the symbols is written first, as it may number more
+        std::vector<char> rest;
+        writeTables(rest);
+        std::vector<char> data;
+        put(data, static_cast<uint32_t>(symbolList.size()));
+        for (Symbol sym : symbolList) {
+            const std::string& name = symbols().name(sym);
+            put(data, static_cast<uint32_t>(name.size()));
+            data.insert(data.end(), name.begin(), name.end());
+        }
+        data.insert(data.end(), rest.begin(), rest.end());
+
+        ImageHeader header{};
+        std::copy(imageMagic, imageMagic + 8, header.magic);
+        header.layout = imageLayout();
+        header.astOffset = sizeof(ImageHeader);
+        header.astSize = ast.size();
+        header.dataOffset = header.astOffset + ast.size();
+        header.dataSize = data.size();
+        std::ofstream out(path, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header), sizeof header);
+        out.write(ast.data(), static_cast<std::streamsize>(ast.size()));
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!out) {
+            throw std::runtime_error(std::string("Cannot write ") + path);
+        }
+    }
+
+private:
+    const Globals& globals;
+    std::vector<std::pair<Symbol, Value>> bindings;
+    std::unordered_map<const Object*, Symbol> builtinNames;
+
+    std::unordered_map<uint32_t, uint32_t> symbolNumbers;
+    std::vector<Symbol> symbolList;
+
+    std::unordered_map<const Object*, uint32_t> objectIndex;
+    std::vector<Value> objectList;
+    std::vector<Value> pendingObjects;
+
+    std::vector<char> ast; // sizes are multiples of 8, so every node stays aligned
+    std::vector<uint32_t> pointerFixups, symbolFixups;
+    std::unordered_map<const Expression*, uint32_t> exprOffsets;
+    std::vector<std::pair<uint32_t, const Expression*>> pendingExprs; // field to point at the node
+    std::unordered_map<const Lambda*, uint32_t> lambdaOffsets, lambdaIndex;
+    std::vector<const Lambda*> lambdaList;
+    std::unordered_map<const Proto*, uint32_t> protoIndex;
+    std::vector<const Proto*> protoList;
+    std::vector<const Proto*> pendingProtos;
+
+    static bool same(const Value& a, const Value& b) { return std::memcmp(&a, &b, sizeof(Value)) == 0; }
+
+    template <typename T>
+    static void put(std::vector<char>& out, const T& value) {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof value);
+    }
+
+    template <typename T>
+    static void putArray(std::vector<char>& out, const std::vector<T>& items) {
+        put(out, static_cast<uint32_t>(items.size()));
+        for (const T& item : items) {
+            put(out, item);
+        }
+    }
+
+    uint32_t symbolNumber(Symbol sym) {
+        auto it = symbolNumbers.find(sym.id);
+        if (it != symbolNumbers.end()) {
+            return it->second;
+        }
+        symbolList.push_back(sym);
+        return symbolNumbers[sym.id] = static_cast<uint32_t>(symbolList.size() - 1);
+    }
+
+    void visit(const Value& value) {
+        if (!value.isObject() || objectIndex.count(value.asObject())) {
+            return;
+        }
+        Object* obj = value.asObject();
+        if (obj->type == ObjectType::Function && value.asFunction()->builtin && !builtinNames.count(obj) &&
+            !memoOf(value)) {
+            throw std::runtime_error("Cannot save a builtin made at run time");
+        }
+        objectIndex[obj] = static_cast<uint32_t>(objectList.size());
+        objectList.push_back(value);
+        pendingObjects.push_back(value);
+    }
+
+    void drain() {
+        while (!pendingObjects.empty()) {
+            Value value = pendingObjects.back();
+            pendingObjects.pop_back();
+            Object* obj = value.asObject();
+            if (obj->type == ObjectType::Pair) {
+                visit(value.asPair()->car);
+                visit(value.asPair()->cdr);
+            } else if (obj->type == ObjectType::Environment && obj != globals.root) {
+                Environment& env = *value.asEnvironment();
+                if (env.outer) {
+                    visit(Value::object(env.outer));
+                }
+                for (uint32_t i = 0; i < env.slotCount; ++i) {
+                    visit(env.slots()[i]);
+                }
+            } else if (Memo* memo = memoOf(value)) {
+                visit(memo->target);
+            } else if (obj->type == ObjectType::Function && !value.asFunction()->builtin) {
+                lambdaNumber(value.asFunction()->lambda);
+                visit(Value::object(value.asFunction()->env));
+            }
+        }
+        while (!pendingExprs.empty()) {
+            auto [field, expr] = pendingExprs.back();
+            pendingExprs.pop_back();
+            setPointer(field, exprOffset(expr));
+        }
+        while (!pendingProtos.empty()) {
+            const Proto* proto = pendingProtos.back();
+            pendingProtos.pop_back();
+            for (const Lambda* lambda : proto->lambdas) {
+                lambdaNumber(lambda);
+            }
+        }
+    }
+
+    uint32_t reserve(size_t bytes) {
+        uint32_t offset = static_cast<uint32_t>(ast.size());
+        ast.resize(ast.size() + (bytes + 7) / 8 * 8);
+        return offset;
+    }
+
+    template <typename T>
+    T* at(uint32_t offset) {
+        return reinterpret_cast<T*>(ast.data() + offset);
+    }
+
+    void setPointer(uint32_t field, uint32_t target) {
+        uint64_t offset = target;
+        std::memcpy(ast.data() + field, &offset, sizeof offset);
+        pointerFixups.push_back(field);
+    }
+
+    void setSymbol(uint32_t field) {
+        Symbol& sym = *at<Symbol>(field);
+        sym.id = symbolNumber(sym);
+        symbolFixups.push_back(field);
+    }
+
+    // Lambdas are written when first reached, so a node can point at one
+    // at once; their bodies are queued
+    uint32_t lambdaNumber(const Lambda* lambda) {
+        auto it = lambdaIndex.find(lambda);
+        if (it != lambdaIndex.end()) {
+            return it->second;
+        }
+        uint32_t offset = reserve(sizeof(Lambda));
+        Lambda copy = *lambda;
+        copy.params = nullptr;
+        copy.program = nullptr;
+        copy.proto = nullptr;
+        std::memcpy(at<Lambda>(offset), &copy, sizeof copy);
+        if (lambda->arity) {
+            uint32_t params = reserve(lambda->arity * sizeof(Symbol));
+            for (uint32_t i = 0; i < lambda->arity; ++i) {
+                *at<Symbol>(params + i * sizeof(Symbol)) = lambda->params[i];
+                setSymbol(params + i * sizeof(Symbol));
+            }
+            setPointer(offset + offsetof(Lambda, params), params);
+        }
+        pendingExprs.push_back({offset + static_cast<uint32_t>(offsetof(Lambda, body)), lambda->body});
+        if (lambda->proto && protoIndex.emplace(lambda->proto, static_cast<uint32_t>(protoList.size())).second) {
+            protoList.push_back(lambda->proto);
+            pendingProtos.push_back(lambda->proto);
+        }
+        lambdaOffsets[lambda] = offset;
+        lambdaList.push_back(lambda);
+        return lambdaIndex[lambda] = static_cast<uint32_t>(lambdaList.size() - 1);
+    }
+
+    uint32_t exprOffset(const Expression* expr) {
+        auto it = exprOffsets.find(expr);
+        if (it != exprOffsets.end()) {
+            return it->second;
+        }
+        uint32_t offset = reserve(sizeof(Expression));
+        std::memcpy(at<Expression>(offset), expr, sizeof(Expression));
+        exprOffsets[expr] = offset;
+        switch (expr->kind) {
+        case Expression::Kind::Number:
+            break;
+        case Expression::Kind::Symbol:
+            setSymbol(offset + offsetof(Expression, symbol));
+            break;
+        case Expression::Kind::Local:
+            setSymbol(offset + offsetof(Expression, local) + offsetof(LocalRef, name));
+            break;
+        case Expression::Kind::Primitive:
+            setSymbol(offset + offsetof(Expression, primitive) + offsetof(PrimitiveRef, name));
+            break;
+        case Expression::Kind::Lambda:
+            lambdaNumber(expr->lambda);
+            setPointer(offset + offsetof(Expression, lambda), lambdaOffsets.at(expr->lambda));
+            break;
+        case Expression::Kind::List:
+            if (!expr->list.empty()) {
+                uint32_t items = reserve(expr->list.size() * sizeof(ExprPtr));
+                setPointer(offset + offsetof(Expression, list) + offsetof(ExprList, items), items);
+                for (size_t i = 0; i < expr->list.size(); ++i) {
+                    pendingExprs.push_back({items + static_cast<uint32_t>(i * sizeof(ExprPtr)), expr->list[i]});
+                }
+            }
+            break;
+        }
+        return offset;
+    }
+
+    void writeTables(std::vector<char>& data) {
+        putArray(data, pointerFixups);
+        putArray(data, symbolFixups);
+        put(data, static_cast<uint32_t>(lambdaList.size()));
+        for (const Lambda* lambda : lambdaList) {
+            put(data, lambdaOffsets.at(lambda));
+            put(data, lambda->proto ? protoIndex.at(lambda->proto) : UINT32_MAX);
+        }
+        put(data, static_cast<uint32_t>(protoList.size()));
+        for (const Proto* proto : protoList) {
+            writeProto(data, *proto);
+        }
+        put(data, static_cast<uint32_t>(objectList.size()));
+        for (const Value& value : objectList) {
+            writeObject(data, value);
+        }
+        put(data, static_cast<uint32_t>(bindings.size()));
+        for (const auto& binding : bindings) {
+            put(data, symbolNumber(binding.first));
+            put(data, encode(binding.second));
+        }
+    }
+
+    void writeProto(std::vector<char>& data, const Proto& proto) {
+        put(data, static_cast<uint32_t>(proto.code.size()));
+        for (Instr instr : proto.code) {
+            if (instr.op == Op::StoreGlobal) {
+                instr.a = symbolNumber(Symbol{instr.a});
+            }
+            put(data, instr);
+        }
+        for (const Value& constant : proto.constants) {
+            if (constant.isObject()) {
+                throw std::runtime_error("Cannot save a code constant that is an object");
+            }
+        }
+        putArray(data, proto.constants);
+        put(data, static_cast<uint32_t>(proto.lambdas.size()));
+        for (const Lambda* lambda : proto.lambdas) {
+            put(data, lambdaIndex.at(lambda));
+        }
+        put(data, static_cast<uint32_t>(proto.locals.size()));
+        for (LocalRef ref : proto.locals) {
+            ref.name.id = symbolNumber(ref.name);
+            put(data, ref);
+        }
+        put(data, static_cast<uint32_t>(proto.globals.size()));
+        for (const GlobalCache& cache : proto.globals) {
+            put(data, symbolNumber(cache.name));
+        }
+    }
+
+    Value encode(const Value& value) const {
+        if (!value.isObject()) {
+            return value;
+        }
+        return Value::object(reinterpret_cast<Object*>(static_cast<uintptr_t>(objectIndex.at(value.asObject()))));
+    }
+
+    uint32_t objectNumber(const Object* obj) const {
+        return obj ? objectIndex.at(obj) + 1 : 0;
+    }
+
+    void writeObject(std::vector<char>& data, const Value& value) {
+        Object* obj = value.asObject();
+        if (builtinNames.count(obj)) {
+            put(data, ImageObject::Builtin);
+            put(data, symbolNumber(builtinNames.at(obj)));
+        } else if (obj == globals.root) {
+            put(data, ImageObject::Root);
+        } else if (Memo* memo = memoOf(value)) {
+            put(data, ImageObject::Memo);
+            put(data, encode(memo->target));
+            put(data, static_cast<uint64_t>(memo->capacity));
+        } else if (obj->type == ObjectType::Pair) {
+            put(data, ImageObject::Pair);
+            put(data, encode(value.asPair()->car));
+            put(data, encode(value.asPair()->cdr));
+        } else if (obj->type == ObjectType::Vector) {
+            const Vector& vector = *value.asVector();
+            put(data, ImageObject::Vector);
+            put(data, static_cast<uint64_t>(vector.length));
+            const char* bytes = reinterpret_cast<const char*>(vector.data());
+            data.insert(data.end(), bytes, bytes + vector.length * sizeof(double));
+        } else if (obj->type == ObjectType::Environment) {
+            Environment& env = *value.asEnvironment();
+            put(data, ImageObject::Environment);
+            put(data, objectNumber(env.outer));
+            put(data, env.slotCount);
+            for (uint32_t i = 0; i < env.slotCount; ++i) {
+                put(data, encode(env.slots()[i]));
+            }
+        } else if (obj->type == ObjectType::Function) {
+            put(data, ImageObject::Closure);
+            put(data, lambdaIndex.at(value.asFunction()->lambda));
+            put(data, objectNumber(value.asFunction()->env));
+        } else {
+            throw std::runtime_error("Cannot save this value");
+        }
+    }
+};
+
+// Reads an image into an instance's globals. Everything it allocates is
+// reachable from `loaded` until the globals take it over.
+class ImageReader : public RootSet {
+public:
+    explicit ImageReader(Globals& globals) : globals(globals) { heap().addRoots(this); }
+    ~ImageReader() { heap().removeRoots(this); }
+
+    void read(const char* path) {
+        auto file = std::make_shared<SourceFile>(path, true);
+        size_t size = file->text().size();
+        char* bytes = file->bytes();
+        ImageHeader header;
+        if (size < sizeof header) {
+            throw std::runtime_error(std::string(path) + " is not an image");
+        }
+        std::memcpy(&header, bytes, sizeof header);
+        if (!std::equal(imageMagic, imageMagic + 8, header.magic)) {
+            throw std::runtime_error(std::string(path) + " is not an image");
+        }
+        if (header.layout != imageLayout()) {
+            throw std::runtime_error(std::string(path) + " was written by a different build");
+        }
+        if (header.astOffset % 8 || header.astOffset > size || header.astSize > size - header.astOffset ||
+            header.dataOffset > size || header.dataSize > size - header.dataOffset ||
+            header.astSize > UINT32_MAX) {
+            invalid();
+        }
+        ast = bytes + header.astOffset;
+        astSize = header.astSize;
+        cursor = bytes + header.dataOffset;
+        end = cursor + header.dataSize;
+
+        Value program = Value::object(heap().make<Program>());
+        loaded.push_back(program);
+        code = program.asProgram();
+        code->image = file;
+        code->imageBytes = size;
+
+        readSymbols();
+        readFixups();
+        readLambdas();
+        readProtos();
+        readObjects();
+        readGlobals();
+        code->account();
+    }
+
+    void traceRoots(Tracer& tracer) override {
+        for (const Value& value : loaded) {
+            tracer.mark(value);
+        }
+    }
+
+private:
+    Globals& globals;
+    char* ast;
+    size_t astSize;
+    const char* cursor;
+    const char* end;
+    Program* code;
+    std::vector<Symbol> symbolMap;
+    std::vector<Lambda*> lambdas;
+    std::vector<Value> loaded; // the program, then every object in image order
+
+    [[noreturn]] static void invalid() { throw std::runtime_error("Invalid image"); }
+
+    template <typename T>
+    T get() {
+        if (static_cast<size_t>(end - cursor) < sizeof(T)) {
+            invalid();
+        }
+        T value;
+        std::memcpy(&value, cursor, sizeof value);
+        cursor += sizeof value;
+        return value;
+    }
+
+    uint32_t count(size_t itemBytes) {
+        uint32_t n = get<uint32_t>();
+        if (n > static_cast<size_t>(end - cursor) / std::max<size_t>(itemBytes, 1)) {
+            invalid();
+        }
+        return n;
+    }
+
+    Symbol symbol(uint32_t number) const {
+        if (number >= symbolMap.size()) {
+            invalid();
+        }
+        return symbolMap[number];
+    }
+
+    template <typename T>
+    T* node(uint32_t offset) const {
+        if (offset % 8 || offset > astSize || sizeof(T) > astSize - offset) {
+            invalid();
+        }
+        return reinterpret_cast<T*>(ast + offset);
+    }
+
+    void readSymbols() {
+        uint32_t n = count(sizeof(uint32_t));
+        symbolMap.reserve(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t length = count(1);
+            symbolMap.push_back(intern(std::string_view(cursor, length)));
+            cursor += length;
+        }
+    }
+
+    void readFixups() {
+        for (uint32_t i = 0, n = count(sizeof(uint32_t)); i < n; ++i) {
+            uint32_t field = get<uint32_t>();
+            if (field % 8 || field > astSize || astSize - field < sizeof(uint64_t)) {
+                invalid();
+            }
+            uint64_t target;
+            std::memcpy(&target, ast + field, sizeof target);
+            if (target >= astSize) {
+                invalid();
+            }
+            char* pointer = ast + target;
+            std::memcpy(ast + field, &pointer, sizeof pointer);
+        }
+        for (uint32_t i = 0, n = count(sizeof(uint32_t)); i < n; ++i) {
+            uint32_t field = get<uint32_t>();
+            if (field % alignof(Symbol) || field > astSize || astSize - field < sizeof(Symbol)) {
+                invalid();
+            }
+            Symbol& sym = *reinterpret_cast<Symbol*>(ast + field);
+            sym = symbol(sym.id);
+        }
+    }
+
+    void readLambdas() {
+        uint32_t n = count(2 * sizeof(uint32_t));
+        std::vector<uint32_t> protos;
+        for (uint32_t i = 0; i < n; ++i) {
+            Lambda* lambda = node<Lambda>(get<uint32_t>());
+            lambda->program = code;
+            lambdas.push_back(lambda);
+            protos.push_back(get<uint32_t>());
+        }
+        // Protos come next; each lambda's is linked once they are built
+        uint32_t protoCount = count(5 * sizeof(uint32_t));
+        for (uint32_t i = 0; i < protoCount; ++i) {
+            code->protos.push_back(std::make_unique<Proto>());
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            if (protos[i] != UINT32_MAX) {
+                if (protos[i] >= protoCount) {
+                    invalid();
+                }
+                lambdas[i]->proto = code->protos[protos[i]].get();
+            }
+        }
+    }
+
+    void readProtos() {
+        for (auto& proto : code->protos) {
+            proto->code.resize(count(sizeof(Instr)));
+            for (Instr& instr : proto->code) {
+                instr = get<Instr>();
+                if (instr.op == Op::StoreGlobal) {
+                    instr.a = symbol(instr.a).id;
+                }
+            }
+            proto->constants.resize(count(sizeof(Value)));
+            for (Value& constant : proto->constants) {
+                constant = get<Value>();
+                if (constant.isObject()) {
+                    invalid();
+                }
+            }
+            proto->lambdas.resize(count(sizeof(uint32_t)));
+            for (Lambda*& lambda : proto->lambdas) {
+                uint32_t index = get<uint32_t>();
+                if (index >= lambdas.size()) {
+                    invalid();
+                }
+                lambda = lambdas[index];
+            }
+            proto->locals.resize(count(sizeof(LocalRef)));
+            for (LocalRef& ref : proto->locals) {
+                ref = get<LocalRef>();
+                ref.name = symbol(ref.name.id);
+            }
+            for (uint32_t i = 0, n = count(sizeof(uint32_t)); i < n; ++i) {
+                proto->globals.emplace_back(symbol(get<uint32_t>()));
+            }
+        }
+    }
+
+    // Objects are made first and filled in after, since they refer to each
+    // other in any order. A collection in between only sees nil, undefined
+    // and null fields.
+    void readObjects() {
+        uint32_t n = count(1);
+        std::vector<std::pair<ImageObject, const char*>> contents;
+        for (uint32_t i = 0; i < n; ++i) {
+            auto kind = get<ImageObject>();
+            contents.push_back({kind, cursor});
+            switch (kind) {
+            case ImageObject::Pair:
+                get<Value>();
+                get<Value>();
+                loaded.push_back(Value::object(Pair::create(Value::nil(), Value::nil())));
+                break;
+            case ImageObject::Vector: {
+                uint64_t length = get<uint64_t>();
+                if (length > maxVectorLength || length * sizeof(double) > static_cast<size_t>(end - cursor)) {
+                    invalid();
+                }
+                Vector* vector = Vector::create(length);
+                std::memcpy(vector->data(), cursor, length * sizeof(double));
+                cursor += length * sizeof(double);
+                loaded.push_back(Value::object(vector));
+                break;
+            }
+            case ImageObject::Environment: {
+                get<uint32_t>();
+                uint32_t slots = count(sizeof(Value));
+                cursor += slots * sizeof(Value);
+                loaded.push_back(Value::object(heap().makeWithExtra<Environment>(slots * sizeof(Value), nullptr,
+                                                                                 &globals, slots)));
+                break;
+            }
+            case ImageObject::Closure: {
+                uint32_t lambda = get<uint32_t>();
+                get<uint32_t>();
+                if (lambda >= lambdas.size()) {
+                    invalid();
+                }
+                loaded.push_back(Value::object(heap().make<Function>(lambdas[lambda], nullptr)));
+                break;
+            }
+            case ImageObject::Builtin: {
+                const Value* builtin = globals.base ? globals.base->find(symbol(get<uint32_t>())) : nullptr;
+                if (!builtin) {
+                    throw std::runtime_error("Image refers to a builtin this build lacks");
+                }
+                loaded.push_back(*builtin);
+                break;
+            }
+            case ImageObject::Root:
+                loaded.push_back(Value::object(globals.root));
+                break;
+            case ImageObject::Memo: {
+                get<Value>();
+                uint64_t capacity = get<uint64_t>();
+                if (capacity == 0 || capacity > UINT32_MAX) {
+                    invalid();
+                }
+                loaded.push_back(makeMemo(Value::nil(), capacity));
+                break;
+            }
+            default:
+                invalid();
+            }
+        }
+        const char* rest = cursor;
+        for (uint32_t i = 0; i < n; ++i) {
+            cursor = contents[i].second;
+            Object* obj = loaded[i + 1].asObject();
+            if (contents[i].first == ImageObject::Pair) {
+                Pair& pair = *loaded[i + 1].asPair();
+                pair.car = decode(get<Value>());
+                pair.cdr = decode(get<Value>());
+                heap().writeBarrier(obj, pair.car);
+                heap().writeBarrier(obj, pair.cdr);
+            } else if (contents[i].first == ImageObject::Environment) {
+                Environment& env = *loaded[i + 1].asEnvironment();
+                env.outer = environment(get<uint32_t>());
+                if (env.outer) {
+                    heap().writeBarrier(obj, Value::object(env.outer));
+                }
+                get<uint32_t>();
+                for (uint32_t slot = 0; slot < env.slotCount; ++slot) {
+                    env.slots()[slot] = decode(get<Value>());
+                    heap().writeBarrier(obj, env.slots()[slot]);
+                }
+            } else if (contents[i].first == ImageObject::Closure) {
+                get<uint32_t>();
+                Function& func = *loaded[i + 1].asFunction();
+                func.env = environment(get<uint32_t>());
+                if (!func.env) {
+                    invalid();
+                }
+                heap().writeBarrier(obj, Value::object(func.env));
+            } else if (contents[i].first == ImageObject::Memo) {
+                Memo& memo = *memoOf(loaded[i + 1]);
+                memo.target = decode(get<Value>());
+                if (!memo.target.isFunction()) {
+                    invalid();
+                }
+                heap().writeBarrier(&memo, memo.target);
+            }
+        }
+        cursor = rest;
+    }
+
+    void readGlobals() {
+        for (uint32_t i = 0, n = count(sizeof(uint32_t) + sizeof(Value)); i < n; ++i) {
+            Symbol name = symbol(get<uint32_t>());
+            globals.root->set(name, decode(get<Value>()));
+        }
+    }
+
+    Value decode(const Value& value) const {
+        if (value.isObject()) {
+            uintptr_t index = reinterpret_cast<uintptr_t>(value.asObject());
+            if (index >= loaded.size() - 1) {
+                invalid();
+            }
+            return loaded[index + 1];
+        }
+        if (!value.isNumber() && !value.isNil() && !value.isUndefined()) {
+            invalid();
+        }
+        return value;
+    }
+
+    Environment* environment(uint32_t number) const {
+        if (number == 0) {
+            return nullptr;
+        }
+        if (number >= loaded.size() || loaded[number].asObject()->type != ObjectType::Environment) {
+            invalid();
+        }
+        return loaded[number].asEnvironment();
+    }
+};
+
+// The builtins every instance starts from. They are made once, on a heap of
+// their own that is then frozen, so any thread can read them and no
+// instance's collector traces into them.
+const Globals& sharedBuiltins() {
+    struct Builtins {
+        Heap memory;
+        Globals globals{memory};
+
+        Builtins() {
+            Context saved = context;
+            context.heap = &memory;
+            addBuiltins(Environment::createGlobal(globals));
+            memory.freeze();
+            context = saved;
+        }
+    };
+    static Builtins builtins;
+    return builtins.globals;
+}
+
+// Interpreter instances
+// The state behind an Interpreter (see lisp.h): its heap, stack, VM,
+// globals and type checker. The values they hold carry no reference
+// counts, so instances running in parallel do not contend on shared
+// counters.
+class Instance {
+public:
+    using Options = Interpreter::Options;
+
+    // Makes an instance the one the calling thread works on while in scope
+    class Scope : public ContextScope {
+    public:
+        explicit Scope(Instance& lisp) : ContextScope({&lisp.memory, &lisp.stack, &lisp.machine, &lisp.globals, lisp.out}) {}
+    };
+
+    explicit Instance(const Options& options)
+        : stack(memory, 1 << 20), machine(memory, stack), globals(memory, &sharedBuiltins()), engine(options.engine),
+          out(options.out) {
+        memory.nurserySize = options.nurserySize;
+        memory.heapLimit = options.heapLimit;
+        Scope scope(*this);
+        Environment::createGlobal(globals);
+        if (options.typecheck) {
+            checker = std::make_unique<TypeChecker>();
+        }
+        if (options.image) {
+            loadImage(options.image);
+        }
+    }
+
+    Instance(const Instance&) = delete;
+    Instance& operator=(const Instance&) = delete;
+
+    // Parses, checks and evaluates every form of `source` in order, calling
+    // visit(value, isDefine) with each result. `offset` tracks the form
+    // being handled, so an error can be located.
+    template <typename Visit>
+    void run(std::string_view source, size_t& offset, Visit visit) {
+        Scope scope(*this);
+        Value program = Value::object(heap().make<Program>());
+        LocalRoot programRoot(program);
+        Program& code = *program.asProgram();
+        for (const Form& form : parseAll(source, code, &offset)) {
+            offset = form.offset;
+            ExprPtr expr = resolve(form.expr, code);
+            bool isDefine = isList(expr) && !expr->list.empty() && isKeyword(expr->list[0], symDefine);
+            if (checker) {
+                checker->check(expr);
+            }
+            Value result;
+            try {
+                result = execute(expr, code, globals.root, engine);
+            } catch (...) {
+                if (checker) {
+                    checker->rollback(); // the define never happened
+                }
+                throw;
+            }
+            visit(result, isDefine);
+        }
+    }
+
+    // Runs a script, printing the value of each form that is not a define.
+    // Errors are reported with the file and line of the form that raised them.
+    void load(const char* path) {
+        SourceFile file(path);
+        size_t offset = 0;
+        try {
+            run(file.text(), offset, [&](const Value& result, bool isDefine) {
+                if (!isDefine) {
+                    printResult(result);
+                }
+            });
+        } catch (const std::exception& ex) {
+            throw std::runtime_error(std::string(path) + ":" + std::to_string(lineOf(file.text(), offset)) + ": " +
+                                     ex.what());
+        }
+    }
+
+    // Runs `source` and returns the printed value of its last form, or an
+    // empty string if it has none
+    std::string eval(std::string_view source) {
+        std::string last;
+        size_t offset = 0;
+        run(source, offset, [&](const Value& result, bool) {
+            std::ostringstream text;
+            printValue(text, result);
+            last = text.str();
+        });
+        return last;
+    }
+
+    // Writes every global defined so far, and all they reach, to `path`
+    void saveImage(const char* path) {
+        Scope scope(*this);
+        ImageWriter(globals).write(path);
+    }
+
+    // Defines the globals saved in an image, as if the scripts that made
+    // them had run. Images hold no types, so a checking instance can't
+    // load one.
+    void loadImage(const char* path) {
+        if (checker) {
+            throw std::runtime_error("Cannot load an image with --typecheck");
+        }
+        Scope scope(*this);
+        ImageReader(globals).read(path);
+    }
+
+    std::ostream& output() { return *out; }
+    const Heap& heapStats() const { return memory; }
+
+    static size_t lineOf(std::string_view text, size_t offset) {
+        return 1 + std::count(text.begin(), text.begin() + std::min(offset, text.size()), '\n');
+    }
+
+private:
+    // Declared in construction order: everything after the heap lives on it
+    Heap memory;
+    ValueStack stack;
+    VM machine;
+    Globals globals;
+    std::unique_ptr<TypeChecker> checker;
+    Engine engine;
+    std::ostream* out;
+};
+
+Interpreter::Interpreter() : Interpreter(Options()) {}
+Interpreter::Interpreter(const Options& options) : instance(std::make_unique<Instance>(options)) {}
+Interpreter::~Interpreter() = default;
+
+void Interpreter::load(const char* path) {
+    instance->load(path);
+}
+
+std::string Interpreter::eval(std::string_view source) {
+    return instance->eval(source);
+}
+
+void Interpreter::saveImage(const char* path) {
+    instance->saveImage(path);
+}
+
+void Interpreter::loadImage(const char* path) {
+    instance->loadImage(path);
+}
+
+std::ostream& Interpreter::output() {
+    return instance->output();
+}
+
+#ifndef LISP_NO_MAIN
+
+// Batch mode: parses the whole file, then evaluates its forms in order and
+// prints the value of each one that is not a define. Stops at the first
+// error, reporting the line of the form that raised it. With iterations,
+// the script instead runs that many times silently, after one untimed
+// warm-up run, and the cost of a run is reported.
+int runFile(Instance& lisp, const char* path, std::ostream& err, size_t iterations = 0) {
+    std::unique_ptr<SourceFile> file;
+    try {
+        file = std::make_unique<SourceFile>(path);
+    } catch (const std::exception& ex) {
+        err << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+    std::string_view text = file->text();
+    size_t offset = 0;
+    auto discard = [](const Value&, bool) {};
+    try {
+        if (!iterations) {
+            lisp.run(text, offset, [](const Value& result, bool isDefine) {
+                if (!isDefine) {
+                    printResult(result);
+                }
+            });
+            return 0;
+        }
+        lisp.run(text, offset, discard);
+        size_t allocationsBefore = allocationCount;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            lisp.run(text, offset, discard);
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        lisp.output() << path << ": " << iterations << " runs, "
+                      << static_cast<uint64_t>(elapsed.count() / iterations) << " ns/op, "
+                      << (allocationCount - allocationsBefore) / iterations << " allocs/op, " << peakRssKb()
+                      << " KB peak RSS\n";
+    } catch (const std::exception& ex) {
+        err << path << ":" << Instance::lineOf(text, offset) << ": Error: " << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+void printGcStats(std::ostream& out, const Heap& heap) {
+    const GcStats& stats = heap.stats;
+    out << "; gc: " << stats.minorCollections << " minor, " << stats.majorCollections << " major, "
+        << stats.totalPauseMs << " ms total pause, " << stats.maxPauseMs << " ms max pause, " << stats.bytesAllocated
+        << " bytes allocated, " << stats.bytesPromoted << " promoted, " << heap.liveBytes() << " in heap\n";
+}
+
+// Runs each script in a fresh instance of its own, `jobs` at a time (0 for
+// one per hardware thread), then writes their output and errors in the
+// order the scripts were given
+int runScripts(const std::vector<const char*>& paths, const Interpreter::Options& options, size_t jobs,
+               size_t iterations, bool gcStats) {
+    std::vector<std::ostringstream> outputs(paths.size()), errors(paths.size());
+    std::vector<int> statuses(paths.size());
+    auto runOne = [&](size_t i) {
+        Interpreter::Options own = options;
+        own.out = &outputs[i];
+        std::unique_ptr<Instance> lisp;
+        try {
+            lisp = std::make_unique<Instance>(own);
+        } catch (const std::exception& ex) {
+            errors[i] << "Error: " << ex.what() << "\n";
+            statuses[i] = 1;
+            return;
+        }
+        statuses[i] = runFile(*lisp, paths[i], errors[i], iterations);
+        if (gcStats) {
+            printGcStats(errors[i], lisp->heapStats());
+        }
+    };
+    if (jobs == 1) {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            runOne(i);
+        }
+    } else {
+        ThreadPool pool(jobs ? jobs - 1 : 0);
+        pool.parallelFor(paths.size(), runOne);
+    }
+    int status = 0;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::cout << outputs[i].str();
+        std::cerr << errors[i].str();
+        status = std::max(status, statuses[i]);
+    }
+    return status;
+}
+
+// Main
+int main(int argc, char** argv) {
+    Interpreter::Options options;
+    bool allocStats = false;
+    bool gcStats = false;
+    const char* statsPath = nullptr;
+    const char* saveImagePath = nullptr;
+    size_t benchIterations = 0;
+    size_t jobs = 0;
+    std::vector<const char*> scripts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--alloc-stats") {
+            allocStats = true;
+        } else if (arg == "--gc-stats") {
+            gcStats = true;
+        } else if (arg == "--typecheck") {
+            options.typecheck = true;
+        } else if (arg == "--engine=tree") {
+            options.engine = Engine::Tree;
+        } else if (arg == "--engine=vm") {
+            options.engine = Engine::VM;
+        } else if (arg.compare(0, 13, "--heap-limit=") == 0) {
+            options.heapLimit = std::strtoull(arg.c_str() + 13, nullptr, 10) << 20;
+        } else if (arg.compare(0, 8, "--bench=") == 0) {
+            benchIterations = std::strtoull(arg.c_str() + 8, nullptr, 10);
+        } else if (arg.compare(0, 7, "--jobs=") == 0) {
+            jobs = std::strtoull(arg.c_str() + 7, nullptr, 10);
+        } else if (arg.compare(0, 13, "--stats-json=") == 0) {
+            statsPath = argv[i] + 13;
+        } else if (arg.compare(0, 8, "--image=") == 0) {
+            options.image = argv[i] + 8;
+        } else if (arg.compare(0, 13, "--save-image=") == 0) {
+            saveImagePath = argv[i] + 13;
+        } else if (arg.compare(0, 10, "--nursery=") == 0) {
+            options.nurserySize = std::strtoull(arg.c_str() + 10, nullptr, 10) << 10;
+        } else if (arg.compare(0, 2, "--") != 0) {
+            scripts.push_back(argv[i]);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--engine=tree|vm] [--typecheck] [--bench=N] [--alloc-stats] [--gc-stats]"
+                         " [--heap-limit=MB] [--nursery=KB] [--stats-json=FILE] [--jobs=N] [--image=FILE]"
+                         " [--save-image=FILE] [file.lisp...]\n";
+            return 1;
+        }
+    }
+    if (saveImagePath && scripts.size() > 1) {
+        std::cerr << "Error: --save-image takes at most one script\n";
+        return 1;
+    }
+
+    int status = 0;
+    if (scripts.size() > 1) {
+        status = runScripts(scripts, options, jobs, benchIterations, gcStats);
+    } else {
+        std::unique_ptr<Instance> instance;
+        try {
+            instance = std::make_unique<Instance>(options);
+        } catch (const std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << "\n";
+            return 1;
+        }
+        Instance& lisp = *instance;
+        std::string line;
+        while (scripts.empty()) {
+            std::cout << "lisp> ";
+            if (!std::getline(std::cin, line)) {
+                break;
+            }
+            try {
+                size_t allocationsBefore = allocationCount;
+                size_t offset = 0;
+                lisp.run(line, offset, [](const Value& result, bool) { printResult(result); });
+                if (allocStats) {
+                    std::cerr << "; " << allocationCount - allocationsBefore << " allocations\n";
+                }
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << "\n";
+            }
+        }
+        if (!scripts.empty()) {
+            status = runFile(lisp, scripts[0], std::cerr, benchIterations);
+        }
+        if (saveImagePath && status == 0) {
+            try {
+                lisp.saveImage(saveImagePath);
+            } catch (const std::exception& ex) {
+                std::cerr << "Error: " << ex.what() << "\n";
+                status = 1;
+            }
+        }
+        if (gcStats) {
+            printGcStats(std::cerr, lisp.heapStats());
+        }
+    }
+    if (statsPath) {
+        std::ofstream out(statsPath);
+        printStatsJson(out);
+        if (!out) {
+            std::cerr << "Error: cannot write " << statsPath << "\n";
+            status = 1;
+        }
+    }
+    return status;
 }
+#endif
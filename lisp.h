@@ -0,0 +1,76 @@
+#ifndef LISP_H
+#define LISP_H
+
+// Embedding API
+// A host program includes this header and links lisp.cpp built with
+// -DLISP_NO_MAIN, which leaves out the command-line main() and the
+// replacement global operator new and delete that count allocations for
+// --alloc-stats. Everything else the interpreter needs stays inside
+// lisp.cpp.
+//
+// Each Interpreter owns its heap, stacks, VM, globals and type checker, so
+// instances share nothing mutable and any number of them can run at once.
+// An instance may move between threads, but only one thread may use it at
+// a time.
+//   Interpreter lisp(options); // create
+//   lisp.load("file.lisp");    // run a script, printing its values
+//   lisp.eval("(+ 1 2)");      // "3"
+// Destroying the instance frees everything it allocated. Errors, in the
+// source or while running it, are thrown as std::runtime_error.
+
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Execution engines: the bytecode VM by default, or the tree-walking eval
+// as a reference implementation
+enum class Engine {
+    Tree,
+    VM,
+};
+
+class Instance;
+
+class Interpreter {
+public:
+    struct Options {
+        Engine engine = Engine::VM;
+        bool typecheck = false;
+        size_t nurserySize = 1 << 20;
+        size_t heapLimit = 0; // bytes; 0 means unlimited
+        std::ostream* out = &std::cout; // where printed values go
+        const char* image = nullptr; // an image to start from, as loadImage
+    };
+
+    Interpreter();
+    explicit Interpreter(const Options& options);
+    ~Interpreter();
+
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
+
+    // Runs a script, printing the value of each form that is not a define.
+    // Errors name the file and line of the form that raised them.
+    void load(const char* path);
+
+    // Runs `source` and returns the printed value of its last form, or an
+    // empty string if it has none
+    std::string eval(std::string_view source);
+
+    // Writes every global defined so far, and all they reach, to `path`
+    void saveImage(const char* path);
+
+    // Defines the globals saved in an image, as if the scripts that made
+    // them had run. Images hold no types, so a checking instance can't
+    // load one.
+    void loadImage(const char* path);
+
+    std::ostream& output();
+
+private:
+    std::unique_ptr<Instance> instance;
+};
+
+#endif
@@ -0,0 +1,389 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+// A Prolog-style clause database and SLD resolution engine over the
+// unifier's terms: constants are atoms, compounds are structures and
+// type variables are logic variables
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "unification.h"
+
+class ClauseDatabase {
+public:
+    explicit ClauseDatabase(OccursCheck check = OccursCheck::Eager) : check(check) {}
+
+    // Adds `head :- body` after the existing clauses of head's predicate.
+    // A fact has no body.
+    void add(const std::shared_ptr<Type>& head, const std::vector<std::shared_ptr<Type>>& body = {}) {
+        Predicate& predicate = predicates[predicateKey(head)];
+        uint32_t index = static_cast<uint32_t>(predicate.clauses.size());
+        predicate.clauses.push_back(compileClause(head, body));
+
+        // Every bucket lists, in order, the clauses whose first argument
+        // has its key plus those whose first argument is a variable
+        uint64_t key;
+        if (firstArgumentKey(head, key)) {
+            auto bucket = predicate.byFirst.find(key);
+            if (bucket == predicate.byFirst.end()) {
+                bucket = predicate.byFirst.emplace(key, predicate.unindexed).first;
+            }
+            bucket->second.push_back(index);
+        } else {
+            predicate.unindexed.push_back(index);
+            for (auto& bucket : predicate.byFirst) {
+                bucket.second.push_back(index);
+            }
+        }
+        ++clauseCount;
+    }
+
+    size_t size() const { return clauseCount; }
+
+    // Resolves the conjunction of goals depth first, calling onSolution
+    // with the query's variables bound for each answer in turn; returning
+    // false from it stops the search. Returns the number of answers found.
+    // The query's variables are unbound again afterwards. The database
+    // must not change during a query.
+    size_t query(const std::vector<std::shared_ptr<Type>>& goals, const std::function<bool()>& onSolution) {
+        Search search(*this);
+        return search.run(goals, onSolution);
+    }
+
+private:
+    // Code that rebuilds a clause with fresh variables: a post-order walk
+    // of its head and body goals. Ground subterms are shared, not copied,
+    // so renaming a fact with no variables costs nothing.
+    struct Op {
+        enum class Kind : uint8_t {
+            Ground,   // push ground[arg]
+            Var,      // push the fresh variable for slot arg
+            Function, // pop two, push an arrow
+            Compound, // pop arg arguments, push a compound like node
+        };
+        Kind kind;
+        uint32_t arg;
+        const TypeCompound* node;
+    };
+
+    struct Clause {
+        std::vector<Op> code;
+        std::vector<std::shared_ptr<Type>> ground;
+        std::vector<const TypeVariable*> vars; // template variable of each slot
+        std::shared_ptr<Type> head;
+        std::vector<std::shared_ptr<Type>> body;
+    };
+
+    struct Predicate {
+        std::vector<Clause> clauses;
+        std::vector<uint32_t> unindexed; // clauses whose first argument is a variable
+        std::unordered_map<uint64_t, std::vector<uint32_t>> byFirst;
+    };
+
+    OccursCheck check;
+    std::unordered_map<uint64_t, Predicate> predicates;
+    size_t clauseCount = 0;
+
+    static uint64_t key(TypeKind kind, uint32_t id, size_t arity) {
+        return static_cast<uint64_t>(kind) << 62 | static_cast<uint64_t>(arity & 0x3fffffff) << 32 | id;
+    }
+
+    // Atoms and compounds name predicates by functor and arity
+    static uint64_t predicateKey(const std::shared_ptr<Type>& goal) {
+        const Type* term = find(goal, false).get();
+        if (term->kind == TypeKind::Constant) {
+            return key(TypeKind::Constant, static_cast<const TypeConstant*>(term)->id, 0);
+        } else if (term->kind == TypeKind::Compound) {
+            auto compound = static_cast<const TypeCompound*>(term);
+            return key(TypeKind::Compound, compound->functor, compound->args.size());
+        }
+        throw std::runtime_error("Not a callable goal: " + term->toString());
+    }
+
+    // False if the first argument is unbound, or there is none
+    static bool firstArgumentKey(const std::shared_ptr<Type>& goal, uint64_t& result) {
+        std::shared_ptr<Type> term = find(goal, false);
+        if (term->kind != TypeKind::Compound || static_cast<const TypeCompound&>(*term).args.empty()) {
+            return false;
+        }
+        std::shared_ptr<Type> first = find(static_cast<const TypeCompound&>(*term).args[0], false);
+        if (first->kind == TypeKind::Constant) {
+            result = key(TypeKind::Constant, static_cast<const TypeConstant&>(*first).id, 0);
+        } else if (first->kind == TypeKind::Compound) {
+            auto compound = static_cast<const TypeCompound*>(first.get());
+            result = key(TypeKind::Compound, compound->functor, compound->args.size());
+        } else if (first->kind == TypeKind::Function) {
+            result = key(TypeKind::Function, 0, 2);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static Clause compileClause(const std::shared_ptr<Type>& head, const std::vector<std::shared_ptr<Type>>& body) {
+        Clause clause;
+        clause.head = head;
+        clause.body = body;
+        std::unordered_map<const Type*, uint32_t> slots;
+        compileTerm(head, clause, slots);
+        for (const auto& goal : body) {
+            compileTerm(goal, clause, slots);
+        }
+        return clause;
+    }
+
+    // A subterm whose children all compiled to single Ground ops is ground
+    // itself, so they are folded into one
+    static void compileTerm(const std::shared_ptr<Type>& term, Clause& clause,
+                            std::unordered_map<const Type*, uint32_t>& slots) {
+        struct Item {
+            std::shared_ptr<Type> term;
+            bool leave;
+        };
+        std::vector<Item> work{{term, false}};
+        while (!work.empty()) {
+            Item item = std::move(work.back());
+            work.pop_back();
+            std::shared_ptr<Type> node = item.term;
+            while (node->kind == TypeKind::Variable && static_cast<TypeVariable&>(*node).binding) {
+                node = static_cast<TypeVariable&>(*node).binding;
+            }
+            if (item.leave) {
+                size_t arity = node->kind == TypeKind::Function ? 2 : static_cast<TypeCompound&>(*node).args.size();
+                bool ground = arity <= clause.code.size();
+                for (size_t i = 0; ground && i < arity; ++i) {
+                    ground = clause.code[clause.code.size() - 1 - i].kind == Op::Kind::Ground;
+                }
+                if (ground) {
+                    clause.ground.resize(clause.ground.size() - arity);
+                    clause.code.resize(clause.code.size() - arity);
+                    clause.code.push_back({Op::Kind::Ground, static_cast<uint32_t>(clause.ground.size()), nullptr});
+                    clause.ground.push_back(node);
+                } else if (node->kind == TypeKind::Function) {
+                    clause.code.push_back({Op::Kind::Function, 2, nullptr});
+                } else {
+                    clause.code.push_back({Op::Kind::Compound, static_cast<uint32_t>(arity),
+                                           static_cast<const TypeCompound*>(node.get())});
+                }
+            } else if (node->kind == TypeKind::Variable) {
+                auto slot = slots.emplace(node.get(), static_cast<uint32_t>(clause.vars.size()));
+                if (slot.second) {
+                    clause.vars.push_back(static_cast<const TypeVariable*>(node.get()));
+                }
+                clause.code.push_back({Op::Kind::Var, slot.first->second, nullptr});
+            } else if (node->kind == TypeKind::Constant) {
+                clause.code.push_back({Op::Kind::Ground, static_cast<uint32_t>(clause.ground.size()), nullptr});
+                clause.ground.push_back(node);
+            } else {
+                work.push_back({node, true});
+                forEachChildReversed(node.get(), [&](const std::shared_ptr<Type>& child) {
+                    work.push_back({child, false});
+                });
+            }
+        }
+    }
+
+    // The goals still to prove, as an immutable list shared between the
+    // current branch and the choicepoints that may resume it
+    struct Goal {
+        std::shared_ptr<Type> term;
+        std::shared_ptr<Goal> next;
+
+        // Unlinks iteratively, so a long list frees without recursion
+        ~Goal() {
+            std::shared_ptr<Goal> rest = std::move(next);
+            while (rest && rest.use_count() == 1) {
+                rest = std::move(rest->next);
+            }
+        }
+    };
+    using Goals = std::shared_ptr<Goal>;
+
+    // Where to resume a call whose remaining clauses have not been tried
+    struct Choice {
+        Goals call; // the call's goal, followed by its continuation
+        const Predicate* predicate;
+        const std::vector<uint32_t>* candidates; // nullptr for every clause
+        size_t next;
+        Trail::Mark mark;
+    };
+
+    class Search {
+    public:
+        explicit Search(ClauseDatabase& db) : db(db), state{db.check, {}, {}, {}, {}, &trail} {}
+
+        size_t run(const std::vector<std::shared_ptr<Type>>& goals, const std::function<bool()>& onSolution) {
+            // Bindings of the query's own variables are reset at the end,
+            // since the trail is cleared whenever nothing can backtrack
+            std::vector<std::shared_ptr<Type>> queryVars;
+            for (const auto& goal : goals) {
+                collectUnbound(goal, queryVars);
+            }
+            struct Reset {
+                std::vector<std::shared_ptr<Type>>& vars;
+                ~Reset() {
+                    for (auto& var : vars) {
+                        static_cast<TypeVariable&>(*var).binding.reset();
+                        static_cast<TypeVariable&>(*var).rank = 0;
+                    }
+                }
+            } reset{queryVars};
+
+            Goals current;
+            for (size_t i = goals.size(); i-- > 0;) {
+                current = std::make_shared<Goal>(Goal{goals[i], std::move(current)});
+            }
+            size_t solutions = 0;
+            bool running = call(std::move(current));
+            while (running) {
+                if (!this->current) {
+                    ++solutions;
+                    if (!onSolution()) {
+                        break;
+                    }
+                    running = backtrack();
+                } else {
+                    running = call(std::move(this->current)) || backtrack();
+                }
+            }
+            return solutions;
+        }
+
+    private:
+        ClauseDatabase& db;
+        Trail trail;
+        UnifyState state;
+        std::vector<Choice> choices;
+        Goals current; // continuation after the last successful step
+        std::vector<std::shared_ptr<Type>> stack;
+        std::vector<std::shared_ptr<Type>> fresh;
+
+        static void collectUnbound(const std::shared_ptr<Type>& term, std::vector<std::shared_ptr<Type>>& vars) {
+            uint32_t stamp = nextVisit();
+            std::vector<std::shared_ptr<Type>> work{term};
+            while (!work.empty()) {
+                std::shared_ptr<Type> type = std::move(work.back());
+                work.pop_back();
+                if (type->seen(stamp)) {
+                    continue;
+                }
+                type->mark(stamp);
+                if (type->kind == TypeKind::Variable) {
+                    auto& var = static_cast<TypeVariable&>(*type);
+                    if (var.binding) {
+                        work.push_back(var.binding);
+                    } else {
+                        vars.push_back(type);
+                    }
+                } else {
+                    forEachChildReversed(type.get(), [&](const std::shared_ptr<Type>& child) { work.push_back(child); });
+                }
+            }
+        }
+
+        // Resolves the first goal of `goals` against the predicate's candidate clauses
+        bool call(Goals goals) {
+            LISP_STAT(ResolveCalls);
+            if (!goals) {
+                current = nullptr;
+                return true;
+            }
+            std::shared_ptr<Type> goal = find(goals->term, false);
+            auto it = db.predicates.find(predicateKey(goal));
+            if (it == db.predicates.end()) {
+                return false;
+            }
+            const Predicate& predicate = it->second;
+            const std::vector<uint32_t>* candidates = nullptr;
+            uint64_t key;
+            if (firstArgumentKey(goal, key)) {
+                auto bucket = predicate.byFirst.find(key);
+                candidates = bucket != predicate.byFirst.end() ? &bucket->second : &predicate.unindexed;
+            }
+            return resume(std::move(goals), predicate, candidates, 0);
+        }
+
+        // Tries candidates from `next` until one's head unifies with the
+        // goal. A choicepoint is left only if others remain, so the last
+        // alternative, and any call the index narrows to one clause, runs
+        // deterministically; with no choicepoints left the trail and the
+        // continuation stop growing, which makes last calls constant space.
+        bool resume(Goals goals, const Predicate& predicate, const std::vector<uint32_t>* candidates, size_t next) {
+            size_t count = candidates ? candidates->size() : predicate.clauses.size();
+            Trail::Mark mark = trail.mark();
+            for (size_t i = next; i < count; ++i) {
+                const Clause& clause = predicate.clauses[candidates ? (*candidates)[i] : i];
+                std::shared_ptr<Type> head = rename(clause);
+                state.bound.clear();
+                state.terms.clear();
+                if (!unifyCells(head, goals->term, state)) {
+                    trail.undoTo(mark);
+                    continue;
+                }
+                if (i + 1 < count) {
+                    choices.push_back({goals, &predicate, candidates, i + 1, mark});
+                } else if (choices.empty()) {
+                    trail.clear();
+                }
+                Goals rest = goals->next;
+                size_t bodySize = clause.body.size();
+                for (size_t j = bodySize; j-- > 0;) {
+                    rest = std::make_shared<Goal>(Goal{clause.vars.empty() ? clause.body[j] : stack[1 + j], std::move(rest)});
+                }
+                current = std::move(rest);
+                return true;
+            }
+            return false;
+        }
+
+        bool backtrack() {
+            while (!choices.empty()) {
+                Choice choice = std::move(choices.back());
+                choices.pop_back();
+                LISP_STAT(ResolveBacktracks);
+                trail.undoTo(choice.mark);
+                if (resume(std::move(choice.call), *choice.predicate, choice.candidates, choice.next)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Rebuilds the clause with fresh variables, leaving its head then
+        // its body goals on the stack; returns the head
+        std::shared_ptr<Type> rename(const Clause& clause) {
+            if (clause.vars.empty()) {
+                return clause.head;
+            }
+            fresh.clear();
+            for (const TypeVariable* var : clause.vars) {
+                fresh.push_back(std::make_shared<TypeVariable>(var->name, var->id));
+            }
+            stack.clear();
+            for (const Op& op : clause.code) {
+                if (op.kind == Op::Kind::Ground) {
+                    stack.push_back(clause.ground[op.arg]);
+                } else if (op.kind == Op::Kind::Var) {
+                    stack.push_back(fresh[op.arg]);
+                } else if (op.kind == Op::Kind::Function) {
+                    auto to = std::move(stack.back());
+                    stack.pop_back();
+                    stack.back() = std::make_shared<TypeFunction>(std::move(stack.back()), std::move(to));
+                } else {
+                    std::vector<std::shared_ptr<Type>> args(std::make_move_iterator(stack.end() - op.arg),
+                                                            std::make_move_iterator(stack.end()));
+                    stack.resize(stack.size() - op.arg);
+                    stack.push_back(std::make_shared<TypeCompound>(op.node->name, op.node->functor, std::move(args)));
+                }
+            }
+            return stack[0];
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Profiling counters
+// Compiled in with -DLISP_STATS=1; otherwise every LISP_STAT* macro expands
+// to nothing and the hot paths carry no trace of them. Counters are kept
+// per thread, so counting in parallel code never contends, and are summed
+// over all threads, live or finished, when a snapshot is taken.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifndef LISP_STATS
+#define LISP_STATS 0
+#endif
+
+#define LISP_STAT_COUNTERS(X) \
+    X(EvalNumber, "eval.number") \
+    X(EvalLocal, "eval.local") \
+    X(EvalGlobal, "eval.global") \
+    X(EvalLambda, "eval.lambda") \
+    X(EvalDefine, "eval.define") \
+    X(EvalIf, "eval.if") \
+    X(EvalPrimitive, "eval.primitive") \
+    X(EvalCall, "eval.call") \
+    X(VmInstructions, "vm.instructions") \
+    X(VmCalls, "vm.calls") \
+    X(VmTailCalls, "vm.tail_calls") \
+    X(VmArithFast, "vm.arith_fast") \
+    X(EnvLocalLookups, "env.local_lookups") \
+    X(EnvDepthWalked, "env.depth_walked") \
+    X(EnvGlobalLookups, "env.global_lookups") \
+    X(AllocExpression, "alloc.expression") \
+    X(AllocEnvironment, "alloc.environment") \
+    X(AllocFunction, "alloc.function") \
+    X(AllocType, "alloc.type") \
+    X(ParseTokens, "parse.tokens") \
+    X(ParseForms, "parse.forms") \
+    X(ParseNs, "parse.ns") \
+    X(UnifyCalls, "unify.calls") \
+    X(UnifySteps, "unify.steps") \
+    X(UnifyBindings, "unify.bindings") \
+    X(UnifyOccursChecks, "unify.occurs_checks") \
+    X(ResolveCalls, "resolve.calls") \
+    X(ResolveBacktracks, "resolve.backtracks") \
+    X(MemoHits, "memo.hits") \
+    X(MemoMisses, "memo.misses") \
+    X(MemoEvictions, "memo.evictions")
+
+enum class Stat : uint8_t {
+#define LISP_STAT_ENUM(name, key) name,
+    LISP_STAT_COUNTERS(LISP_STAT_ENUM)
+#undef LISP_STAT_ENUM
+    Count,
+};
+
+constexpr size_t statCount = static_cast<size_t>(Stat::Count);
+
+inline const char* statName(size_t index) {
+    static const char* const names[] = {
+#define LISP_STAT_NAME(name, key) key,
+        LISP_STAT_COUNTERS(LISP_STAT_NAME)
+#undef LISP_STAT_NAME
+    };
+    return names[index];
+}
+
+// Calls and cumulative time of one named operation, such as a builtin
+struct CallStat {
+    std::string name;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> ns{0};
+
+    explicit CallStat(std::string name) : name(std::move(name)) {}
+};
+
+class StatRegistry {
+public:
+    // One thread's counters. Only the owning thread writes them; relaxed
+    // atomics let a snapshot read them while it runs.
+    struct Block {
+        std::atomic<uint64_t> values[statCount] = {};
+
+        Block() { registry().attach(this); }
+        ~Block() { registry().detach(this); }
+    };
+
+    static StatRegistry& registry() {
+        static auto* instance = new StatRegistry(); // outlives every thread's block
+        return *instance;
+    }
+
+    static Block& local() {
+        thread_local Block block;
+        return block;
+    }
+
+    std::vector<uint64_t> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<uint64_t> totals(retired, retired + statCount);
+        for (Block* block : blocks) {
+            for (size_t i = 0; i < statCount; ++i) {
+                totals[i] += block->values[i].load(std::memory_order_relaxed);
+            }
+        }
+        return totals;
+    }
+
+    // Finds or adds the entry for `name`; entries are never removed, so the
+    // reference stays valid
+    CallStat& call(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (CallStat& stat : calls) {
+            if (stat.name == name) {
+                return stat;
+            }
+        }
+        calls.emplace_back(name);
+        return calls.back();
+    }
+
+    template <typename Visit>
+    void forEachCall(Visit visit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const CallStat& stat : calls) {
+            visit(stat);
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<Block*> blocks;
+    uint64_t retired[statCount] = {}; // totals of threads that have exited
+    std::deque<CallStat> calls;
+
+    void attach(Block* block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        blocks.push_back(block);
+    }
+
+    void detach(Block* block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < statCount; ++i) {
+            retired[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+        blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+    }
+};
+
+inline void statAdd(Stat stat, uint64_t amount) {
+    std::atomic<uint64_t>& value = StatRegistry::local().values[static_cast<size_t>(stat)];
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Adds the lifetime of the scope, in nanoseconds, to a counter
+class StatTimer {
+public:
+    explicit StatTimer(Stat stat) : stat(stat), start(std::chrono::steady_clock::now()) {}
+    ~StatTimer() { statAdd(stat, elapsedNs(start)); }
+
+    static uint64_t elapsedNs(std::chrono::steady_clock::time_point since) {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count());
+    }
+
+private:
+    Stat stat;
+    std::chrono::steady_clock::time_point start;
+};
+
+#if LISP_STATS
+#define LISP_STAT(name) statAdd(Stat::name, 1)
+#define LISP_STAT_ADD(name, amount) statAdd(Stat::name, (amount))
+#define LISP_STAT_TIME(name) StatTimer statTimer##name(Stat::name)
+#else
+#define LISP_STAT(name) ((void)0)
+#define LISP_STAT_ADD(name, amount) ((void)0)
+#define LISP_STAT_TIME(name) ((void)0)
+#endif
+
+// Human-readable report, for the REPL
+inline void printStats(std::ostream& out) {
+    if (!LISP_STATS) {
+        out << "; stats are not compiled in; rebuild with -DLISP_STATS=1\n";
+        return;
+    }
+    std::vector<uint64_t> totals = StatRegistry::registry().snapshot();
+    for (size_t i = 0; i < statCount; ++i) {
+        if (totals[i]) {
+            out << "; " << statName(i) << " " << totals[i] << "\n";
+        }
+    }
+    StatRegistry::registry().forEachCall([&](const CallStat& stat) {
+        out << "; call " << stat.name << " " << stat.calls.load() << " calls " << stat.ns.load() << " ns\n";
+    });
+}
+
+// Machine-readable report: one JSON object listing every counter, zero or
+// not, so the set of keys only changes when the build does
+inline void printStatsJson(std::ostream& out) {
+    std::vector<uint64_t> totals = StatRegistry::registry().snapshot();
+    out << "{\"enabled\": " << (LISP_STATS ? "true" : "false") << ", \"counters\": {";
+    if (LISP_STATS) {
+        for (size_t i = 0; i < statCount; ++i) {
+            out << (i ? ", " : "") << "\"" << statName(i) << "\": " << totals[i];
+        }
+    }
+    out << "}, \"calls\": {";
+    bool first = true;
+    StatRegistry::registry().forEachCall([&](const CallStat& stat) {
+        out << (first ? "" : ", ") << "\"";
+        for (char c : stat.name) {
+            if (c == '"' || c == '\\') {
+                out << '\\';
+            }
+            out << c;
+        }
+        out << "\": {\"calls\": " << stat.calls.load() << ", \"ns\": " << stat.ns.load() << "}";
+        first = false;
+    });
+    out << "}}\n";
+}
+
+#endif
@@ -0,0 +1,76 @@
+// A host program using the embedding API: it has its own main() and its
+// own global operator new, and links lisp.cpp built with -DLISP_NO_MAIN.
+// Prints what each step returned, for tests/embed.expected.
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "../lisp.h"
+
+static size_t hostAllocations = 0;
+
+void* operator new(size_t size) {
+    ++hostAllocations;
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+int main() {
+    Interpreter lisp;
+    std::cout << lisp.eval("(define sq (lambda (x) (* x x)))") << "\n";
+    std::cout << lisp.eval("(sq 12)") << "\n";
+    std::cout << lisp.eval("") << "\n";
+    try {
+        lisp.eval("(car ())");
+    } catch (const std::runtime_error& ex) {
+        std::cout << "error: " << ex.what() << "\n";
+    }
+
+    // Instances are independent, and may run on threads of their own
+    std::string results[2];
+    std::thread threads[2];
+    for (int i = 0; i < 2; ++i) {
+        threads[i] = std::thread([&results, i] {
+            Interpreter::Options options;
+            options.engine = i == 0 ? Engine::VM : Engine::Tree;
+            Interpreter own(options);
+            own.eval("(define f (lambda (n) (if (< n 2) n (+ (f (- n 1)) (f (- n 2))))))");
+            results[i] = own.eval("(f 20)");
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::cout << results[0] << " " << results[1] << "\n";
+
+    // Printed values go to the instance's stream
+    std::ostringstream printed;
+    Interpreter::Options options;
+    options.out = &printed;
+    options.typecheck = true;
+    Interpreter checked(options);
+    try {
+        checked.eval("(+ 1 (cons 1 ()))");
+    } catch (const std::runtime_error& ex) {
+        std::cout << "error: " << ex.what() << "\n";
+    }
+    std::cout << checked.eval("(stats)").size() << " " << !printed.str().empty() << "\n";
+
+    std::cout << (hostAllocations > 0 ? "host allocator used" : "host allocator unused") << "\n";
+    return 0;
+}
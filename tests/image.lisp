@@ -0,0 +1,11 @@
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+(define add5 (make-adder 5))
+(define twice (lambda (f) (lambda (x) (f (f x)))))
+(define add10 (twice add5))
+(define nums (list 1 2 3 4))
+(define nested (cons (list 1 2) (cons (vec 1 2 3) ())))
+(define shared (list nums nums))
+(define v (vec-range 5))
+(define-memo fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(define scale (lambda (k) (map-num (lambda (x) (* x k)) v)))
+(fib 30)
@@ -0,0 +1,3 @@
+(define d (lambda (n) (if (< n 1) 0 (+ 1 (car (map (lambda (x) (d (- n 1))) (list 1)))))))
+(d 1000)
+(d 200000)
@@ -0,0 +1,17 @@
+(define-memo fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(fib 90)
+(define tiny (memoize (lambda (x y) (* x y)) 1))
+(tiny 2 3)
+(tiny 4 5)
+(tiny 2 3)
+(define-memo len (lambda (l) (length l)))
+(len (list 1 2 3))
+(len (list 1 2))
+(define-memo k (lambda () 42))
+(k)
+(define-memo pf (lambda (n) (if (< n 2) n (+ (pf (- n 1)) (pf (- n 2))))))
+(pmap pf (list 40 60 80))
+(preduce + 0 (pmap pf (list 30 31 32)))
+(define-memo m (lambda (n) (if (< n 1) 0 (+ 1 (m (- n 1))))))
+(m 1000)
+(m 20000)
@@ -0,0 +1,11 @@
+(define nest (lambda (n acc) (if (== n 0) acc (nest (- n 1) (cons acc ())))))
+(define depth (lambda (l n) (if (null? l) n (depth (car l) (+ n 1)))))
+(define range (lambda (a b) (if (< a b) (cons a (range (+ a 1) b)) ())))
+(pmap (lambda (x) (* x x)) (range 0 10))
+(preduce + 0 (range 0 100))
+(preduce + 7 ())
+(pmap (lambda (l) (depth l 0)) (pmap (lambda (x) (nest 100000 ())) (list 1 2)))
+(length (pmap (lambda (x) (nest 100000 ())) (list 1 2)))
+(map (lambda (f) (f 10)) (pmap (lambda (x) (lambda (y) (+ x y))) (list 1 2 3)))
+(pmap (lambda (x) (vec-range x)) (list 2 3))
+(preduce (lambda (a b) (vec-add a b)) (vec 1 1 1) (pmap (lambda (x) (make-vec 3 x)) (range 0 5)))
@@ -0,0 +1,80 @@
+#!/bin/sh
+# Builds the interpreter and runs every tests/*.lisp script on both
+# engines, comparing what it prints, errors included, with the script's
+# .expected file. A script stops at its first error, so a test of an
+# error ends with the form that raises it; a .repl file is typed into the
+# REPL instead, which carries on after errors. A .flags file beside either
+# holds extra interpreter options. image.lisp is also saved as an image by
+# each engine, and image.reload run against it on each, checked against
+# image.reload.expected. embed.cpp is a host program linked against the
+# library build of the interpreter (see lisp.h), checked against
+# embed.expected.
+#
+# Scripts (the interpreter has no comment syntax, so they are described
+# here):
+#   map_recursion  recursion through map's callback, within the depth
+#                  limit and then far past it
+#   memo           memoize and define-memo: hits, capacity, non-numeric
+#                  arguments, memoized recursion inside pmap and preduce,
+#                  then memoized recursion past the depth limit
+#   parallel       pmap and preduce, with results that are deep lists,
+#                  closures and vectors copied back from the workers
+#   image          closures and the frames they captured, shared lists,
+#                  vectors and a memoized function, used again after the
+#                  image is loaded
+#   typecheck      --typecheck sessions: inference, type errors, and a
+#                  define whose value fails to evaluate leaving its global
+#                  free to be defined again
+#
+# Usage: tests/run.sh
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+CXX=${CXX:-g++}
+$CXX -std=c++17 -O2 -pthread -o "$out/lisp_interpreter" "$here/../lisp.cpp"
+$CXX -std=c++17 -O2 -pthread -DLISP_NO_MAIN -o "$out/embed" "$here/embed.cpp" "$here/../lisp.cpp"
+
+cd "$here"
+failed=0
+for script in *.lisp *.repl; do
+    name=${script%.*}
+    flags=$(cat "$name.flags" 2>/dev/null || true)
+    for engine in vm tree; do
+        case $script in
+        *.repl) "$out/lisp_interpreter" --engine=$engine $flags < "$script" > "$out/actual" 2>&1 || true ;;
+        *) "$out/lisp_interpreter" --engine=$engine $flags "$script" > "$out/actual" 2>&1 || true ;;
+        esac
+        if cmp -s "$out/actual" "$name.expected"; then
+            echo "ok   $script ($engine)"
+        else
+            echo "FAIL $script ($engine)"
+            diff "$name.expected" "$out/actual" || true
+            failed=1
+        fi
+    done
+done
+for saver in vm tree; do
+    for loader in vm tree; do
+        "$out/lisp_interpreter" --engine=$saver --save-image="$out/image" image.lisp > /dev/null 2>&1 || true
+        "$out/lisp_interpreter" --engine=$loader --image="$out/image" image.reload > "$out/actual" 2>&1 || true
+        if cmp -s "$out/actual" image.reload.expected; then
+            echo "ok   image.reload ($saver image, $loader)"
+        else
+            echo "FAIL image.reload ($saver image, $loader)"
+            diff image.reload.expected "$out/actual" || true
+            failed=1
+        fi
+    done
+done
+"$out/embed" > "$out/actual" 2>&1 || true
+if cmp -s "$out/actual" embed.expected; then
+    echo "ok   embed.cpp"
+else
+    echo "FAIL embed.cpp"
+    diff embed.expected "$out/actual" || true
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,197 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads with a task deque each. A worker pushes
+// and pops its own tasks at the front, so the work it spawns stays hot in
+// its cache, and an idle worker steals from the back of someone else's.
+// Tasks submitted from outside the pool go to a shared queue. parallelFor
+// is the usual entry point: the calling thread works alongside the pool,
+// so a pool of N threads runs a loop on up to N + 1 cores, and while it
+// waits for the loop to drain it runs other tasks, so loops may nest.
+class ThreadPool {
+public:
+    // 0 threads means one per hardware thread, less the caller's
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) {
+            unsigned hardware = std::thread::hardware_concurrency();
+            threads = hardware > 1 ? hardware - 1 : 1;
+        }
+        for (size_t i = 0; i <= threads; ++i) {
+            queues.push_back(std::make_unique<Queue>()); // the last one is the shared queue
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    void submit(std::function<void()> task) {
+        pending.fetch_add(1); // counted first, so it never drops below the queued tasks
+        if (currentPool == this) {
+            Queue& own = *queues[currentIndex];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.tasks.push_front(std::move(task));
+        } else {
+            Queue& shared = *queues.back();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            shared.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex); // a worker about to sleep sees the count
+        }
+        ready.notify_one();
+    }
+
+    // Runs body(i) for every i in [0, count), handing out indices one at a
+    // time so uneven iterations balance themselves. Returns once all have
+    // finished; the first exception thrown by an iteration is rethrown.
+    template <typename Body>
+    void parallelFor(size_t count, Body body) {
+        struct Loop {
+            std::atomic<size_t> next{0};
+            std::atomic<bool> failed{false};
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable finished;
+            size_t helpersLeft = 0;
+        };
+        auto loop = std::make_shared<Loop>();
+        auto run = [loop, count, &body] {
+            for (size_t i; !loop->failed.load() && (i = loop->next.fetch_add(1)) < count;) {
+                try {
+                    body(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(loop->mutex);
+                    if (!loop->failed.exchange(true)) {
+                        loop->error = std::current_exception();
+                    }
+                }
+            }
+        };
+
+        size_t helpers = count > 1 ? std::min(workers.size(), count - 1) : 0;
+        loop->helpersLeft = helpers;
+        for (size_t i = 0; i < helpers; ++i) {
+            submit([loop, run] {
+                run();
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                if (--loop->helpersLeft == 0) {
+                    loop->finished.notify_one();
+                }
+            });
+        }
+        run();
+
+        // Helpers not yet started are run here rather than waited for; one
+        // running elsewhere is waited for in short naps, between which any
+        // task it spawned may be picked up
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(loop->mutex);
+                if (loop->helpersLeft == 0) {
+                    break;
+                }
+            }
+            if (!runPending(currentPool == this ? currentIndex : queues.size() - 1)) {
+                std::unique_lock<std::mutex> lock(loop->mutex);
+                loop->finished.wait_for(lock, std::chrono::microseconds(100), [&] { return loop->helpersLeft == 0; });
+            }
+        }
+        if (loop->error) {
+            std::rethrow_exception(loop->error);
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // Which pool, if any, the running thread works for, and its queue
+    static inline thread_local ThreadPool* currentPool = nullptr;
+    static inline thread_local size_t currentIndex = 0;
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> pending{0}; // tasks submitted and not yet taken
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping = false;
+
+    // Takes a task from the front of queue `self`, else from the shared
+    // queue, else from the back of another worker's, and runs it
+    bool runPending(size_t self) {
+        std::function<void()> task;
+        auto take = [&](Queue& queue, bool front) {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                return false;
+            }
+            if (front) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            return true;
+        };
+        bool found = take(*queues[self], true) || take(*queues.back(), true);
+        for (size_t i = 0; !found && i + 1 < queues.size(); ++i) {
+            size_t victim = (self + 1 + i) % (queues.size() - 1);
+            found = victim != self && take(*queues[victim], false);
+        }
+        if (!found) {
+            return false;
+        }
+        pending.fetch_sub(1);
+        task();
+        return true;
+    }
+
+    void work(size_t index) {
+        currentPool = this;
+        currentIndex = index;
+        while (true) {
+            if (runPending(index)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return stopping || pending.load() > 0; });
+            if (stopping && pending.load() == 0) {
+                return;
+            }
+        }
+    }
+};
+
+#endif
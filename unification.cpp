@@ -1,119 +1,11 @@
+#include <cstring>
+#include <fstream>
 #include <iostream>
-#include <memory>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
-#include <stdexcept>
 
-class Type {
-public:
-    virtual ~Type() = default;
-    virtual std::string toString() const = 0; // does nothing
-    virtual std::shared_ptr<Type> apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) const = 0;
-    virtual void collectFreeTypeVars(std::unordered_set<std::string>& vars) const = 0;
-};
-
-class TypeVariable : public Type {
-public:
-    std::string name;
-
-    TypeVariable(const std::string& name) : name(name) {}
-
-    std::string toString() const override {
-        return name;
-    }
-
-    std::shared_ptr<Type> apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) const override {
-        auto it = subst.find(name);
-        if (it != subst.end()) {
-            return it->second->apply(subst);
-        }
-        return std::make_shared<TypeVariable>(name);
-    }
-
-    void collectFreeTypeVars(std::unordered_set<std::string>& vars) const override {
-        vars.insert(name);
-    }
-};
-
-class TypeConstant : public Type {
-public:
-    std::string name;
-
-    TypeConstant(const std::string& name) : name(name) {}
-
-    std::string toString() const override {
-        return name;
-    }
-
-    std::shared_ptr<Type> apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) const override {
-        return std::make_shared<TypeConstant>(name);
-    }
-
-    void collectFreeTypeVars(std::unordered_set<std::string>& vars) const override {
-    }
-};
-
-class TypeFunction : public Type {
-public:
-    std::shared_ptr<Type> from;
-    std::shared_ptr<Type> to;
-
-    TypeFunction(std::shared_ptr<Type> from, std::shared_ptr<Type> to) : from(from), to(to) {}
-
-    std::string toString() const override {
-        return "(" + from->toString() + " -> " + to->toString() + ")";
-    }
-
-    std::shared_ptr<Type> apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) const override {
-        return std::make_shared<TypeFunction>(from->apply(subst), to->apply(subst));
-    }
-
-    void collectFreeTypeVars(std::unordered_set<std::string>& vars) const override {
-        from->collectFreeTypeVars(vars);
-        to->collectFreeTypeVars(vars);
-    }
-};
-
-// Occurs check to prevent infinite types
-bool occursInType(const std::string& varName, std::shared_ptr<Type> type) {
-    std::unordered_set<std::string> vars;
-    type->collectFreeTypeVars(vars);
-    return vars.find(varName) != vars.end();
-}
-
-// The unification algorithm
-void unify(std::shared_ptr<Type> t1, std::shared_ptr<Type> t2, std::unordered_map<std::string, std::shared_ptr<Type>>& subst) {
-    t1 = t1->apply(subst);
-    t2 = t2->apply(subst);
-
-    if (auto var1 = std::dynamic_pointer_cast<TypeVariable>(t1)) {
-        if (t1->toString() != t2->toString()) {
-            if (occursInType(var1->name, t2)) {
-                throw std::runtime_error("Occurs check failed: " + var1->name + " occurs in " + t2->toString());
-            }
-            subst[var1->name] = t2;
-        }
-    }
-    else if (auto var2 = std::dynamic_pointer_cast<TypeVariable>(t2)) {
-        unify(t2, t1, subst);
-    }
-    else if (auto func1 = std::dynamic_pointer_cast<TypeFunction>(t1)) {
-        if (auto func2 = std::dynamic_pointer_cast<TypeFunction>(t2)) {
-            unify(func1->from, func2->from, subst);
-            unify(func1->to, func2->to, subst);
-        }
-        else {
-            throw std::runtime_error("Type mismatch: " + t1->toString() + " vs " + t2->toString());
-        }
-    }
-    else if (t1->toString() == t2->toString()) {
-        // Type constants are equal
-    }
-    else {
-        throw std::runtime_error("Type mismatch: " + t1->toString() + " vs " + t2->toString());
-    }
-}
+#include "resolution.h"
+#include "unification.h"
 
 // Function to print the substitutions
 void printSubstitution(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) {
@@ -123,19 +15,29 @@ void printSubstitution(const std::unordered_map<std::string, std::shared_ptr<Typ
     }
 }
 
-int main() {
+int main(int argc, char** argv) {
+    const char* statsPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--stats-json=", 13) == 0) {
+            statsPath = argv[i] + 13;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--stats-json=FILE]\n";
+            return 1;
+        }
+    }
+
     try {
         // Example Types:
         // t1: (a -> b)
         // t2: (Int -> Bool)
 
-        auto a = std::make_shared<TypeVariable>("a");
-        auto b = std::make_shared<TypeVariable>("b");
-        auto t1 = std::make_shared<TypeFunction>(a, b);
+        auto a = types().variable("a");
+        auto b = types().variable("b");
+        auto t1 = types().function(a, b);
 
-        auto intType = std::make_shared<TypeConstant>("Int");
-        auto boolType = std::make_shared<TypeConstant>("Bool");
-        auto t2 = std::make_shared<TypeFunction>(intType, boolType);
+        auto intType = types().constant("Int");
+        auto boolType = types().constant("Bool");
+        auto t2 = types().function(intType, boolType);
 
         std::unordered_map<std::string, std::shared_ptr<Type>> subst;
 
@@ -151,10 +53,40 @@ int main() {
 
         std::cout << "Unified t1: " << t1Unified->toString() << "\n";
         std::cout << "Unified t2: " << t2Unified->toString() << "\n";
+
+        // Resolution over a clause database:
+        // parent(tom, bob). parent(bob, ann). parent(bob, pat).
+        // ancestor(X, Y) :- parent(X, Y).
+        // ancestor(X, Y) :- parent(X, Z), ancestor(Z, Y).
+        auto atom = [](const std::string& name) { return types().constant(name); };
+        auto term = [](const std::string& name, std::vector<std::shared_ptr<Type>> args) {
+            return types().compound(name, std::move(args));
+        };
+        ClauseDatabase db;
+        db.add(term("parent", {atom("tom"), atom("bob")}));
+        db.add(term("parent", {atom("bob"), atom("ann")}));
+        db.add(term("parent", {atom("bob"), atom("pat")}));
+        auto x = types().variable("X");
+        auto y = types().variable("Y");
+        auto z = types().variable("Z");
+        db.add(term("ancestor", {x, y}), {term("parent", {x, y})});
+        db.add(term("ancestor", {x, y}), {term("parent", {x, z}), term("ancestor", {z, y})});
+
+        auto who = types().variable("Who");
+        std::cout << "ancestor(tom, Who):\n";
+        db.query({term("ancestor", {atom("tom"), who})}, [&] {
+            std::cout << "Who := " << find(who, false)->toString() << "\n";
+            return true;
+        });
     }
     catch (const std::exception& ex) {
         std::cerr << "Unification failed: " << ex.what() << "\n";
     }
 
+    if (statsPath) {
+        std::ofstream out(statsPath);
+        printStatsJson(out);
+    }
+
     return 0;
 }
@@ -0,0 +1,946 @@
+#ifndef UNIFICATION_H
+#define UNIFICATION_H
+
+// Types and first-order unification over them, shared by the unification
+// demo and the Lisp interpreter's type checker
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include "stats.h"
+#include "thread_pool.h"
+
+// Names of variables and constants are interned to dense ids, so the
+// unifier compares integers and strings are only built for diagnostics.
+// Programs that type-check on several threads share the table, so it locks.
+class NameTable {
+public:
+    uint32_t intern(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.push_back(name);
+        ids.emplace(name, id);
+        return id;
+    }
+
+    const std::string& name(uint32_t id) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return names[id];
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::deque<std::string> names; // deque keeps name() references stable
+};
+
+inline NameTable& typeNames() {
+    static NameTable table;
+    return table;
+}
+
+enum class TypeKind : uint8_t {
+    Variable,
+    Constant,
+    Function,
+    Compound,
+};
+
+// Each traversal takes a new stamp, so marking a node as seen never needs
+// a separate set or a pass to clear it. Stamps are unique across threads.
+inline uint32_t nextVisit() {
+    static std::atomic<uint32_t> stamp{0};
+    return stamp.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+class TypeFactory;
+
+// Traversals below are iterative over an explicit stack, so the depth of a
+// type is bounded only by memory
+class Type : public std::enable_shared_from_this<Type> {
+public:
+    const TypeKind kind;
+    const bool ground; // contains no variables, bound or not
+
+    // Stamp of the last traversal that reached this node. Hash-consed nodes
+    // are shared by traversals on other threads; one overwriting another's
+    // stamp only makes a node be visited again.
+    mutable std::atomic<uint32_t> visited{0};
+
+    bool seen(uint32_t stamp) const { return visited.load(std::memory_order_relaxed) == stamp; }
+    void mark(uint32_t stamp) const { visited.store(stamp, std::memory_order_relaxed); }
+
+    Type(TypeKind kind, bool ground) : kind(kind), ground(ground) { LISP_STAT(AllocType); }
+    virtual ~Type() = default;
+
+    std::string toString() const; // for diagnostics only
+    std::shared_ptr<Type> apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) const;
+    // As above, building any new nodes through `factory`
+    std::shared_ptr<Type> apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst,
+                                TypeFactory& factory) const;
+    void collectFreeTypeVars(std::unordered_set<std::string>& vars) const;
+
+protected:
+    std::shared_ptr<Type> self() const {
+        return std::const_pointer_cast<Type>(shared_from_this());
+    }
+
+    // Drops a reference to a child. Nodes freed as a result are destroyed
+    // from a queue rather than recursively, so freeing a deep type does not
+    // grow the native stack either. Each thread has a queue of its own: a
+    // node is always freed by the thread that drops its last reference, so
+    // threads never wait on each other to free. Once the queue is gone, as
+    // the thread exits, nodes are freed directly.
+    static void release(std::shared_ptr<Type>& child) {
+        static thread_local bool exited = false;
+        struct Queue {
+            std::vector<std::shared_ptr<Type>> nodes;
+            bool draining = false;
+            ~Queue() { exited = true; }
+        };
+        static thread_local Queue queue;
+        if (!child) {
+            return;
+        }
+        if (exited) {
+            child.reset();
+            return;
+        }
+        queue.nodes.push_back(std::move(child));
+        if (queue.draining) {
+            return;
+        }
+        queue.draining = true;
+        while (!queue.nodes.empty()) {
+            std::shared_ptr<Type> last = std::move(queue.nodes.back());
+            queue.nodes.pop_back();
+            last.reset(); // may queue this node's children
+        }
+        queue.draining = false;
+    }
+};
+
+// A type variable is a union-find cell: unification binds it in place to
+// the type it was unified with, which may be another variable. Unbound
+// variables are the representatives of their class.
+class TypeVariable : public Type {
+public:
+    std::string name;
+    uint32_t id; // of the interned name; fresh variables have none
+    std::shared_ptr<Type> binding;
+    unsigned rank = 0; // union by rank, for variable-variable bindings
+    mutable bool onPath = false; // inside this variable's binding during a traversal
+
+    TypeVariable(const std::string& name) : Type(TypeKind::Variable, false), name(name), id(typeNames().intern(name)) {}
+
+    // A distinct variable sharing an already interned name, as made when
+    // renaming a clause apart
+    TypeVariable(const std::string& name, uint32_t id) : Type(TypeKind::Variable, false), name(name), id(id) {}
+    ~TypeVariable() override { release(binding); }
+};
+
+class TypeConstant : public Type {
+public:
+    std::string name;
+    uint32_t id;
+
+    TypeConstant(const std::string& name) : Type(TypeKind::Constant, true), name(name), id(typeNames().intern(name)) {}
+};
+
+class TypeFunction : public Type {
+public:
+    std::shared_ptr<Type> from;
+    std::shared_ptr<Type> to;
+
+    TypeFunction(std::shared_ptr<Type> from, std::shared_ptr<Type> to)
+        : Type(TypeKind::Function, from->ground && to->ground), from(from), to(to) {}
+
+    ~TypeFunction() override {
+        release(from);
+        release(to);
+    }
+};
+
+// An n-ary constructor applied to arguments, such as a tuple or a term of
+// a logic program. The functor's name is interned, and the arguments are
+// one contiguous array, so unifying two compounds compares an id and an
+// arity and then walks both arrays in step.
+class TypeCompound : public Type {
+public:
+    std::string name;
+    uint32_t functor;
+    std::vector<std::shared_ptr<Type>> args;
+
+    TypeCompound(const std::string& name, std::vector<std::shared_ptr<Type>> args)
+        : TypeCompound(name, typeNames().intern(name), std::move(args)) {}
+
+    TypeCompound(const std::string& name, uint32_t functor, std::vector<std::shared_ptr<Type>> args)
+        : Type(TypeKind::Compound, allGround(args)), name(name), functor(functor), args(std::move(args)) {}
+
+    ~TypeCompound() override {
+        for (auto& arg : args) {
+            release(arg);
+        }
+    }
+
+private:
+    static bool allGround(const std::vector<std::shared_ptr<Type>>& args) {
+        return std::all_of(args.begin(), args.end(), [](const std::shared_ptr<Type>& arg) { return arg->ground; });
+    }
+};
+
+// Calls visit on each direct subterm of an arrow or compound, last first,
+// so a traversal that pushes them onto its stack pops them in order. visit
+// takes either the raw pointer or, to keep the subterm, its shared_ptr.
+template <typename Visit>
+void forEachChildReversed(const Type* type, Visit visit) {
+    auto each = [&](const std::shared_ptr<Type>& child) {
+        if constexpr (std::is_invocable_v<Visit&, const Type*>) {
+            visit(child.get());
+        } else {
+            visit(child);
+        }
+    };
+    if (type->kind == TypeKind::Function) {
+        auto func = static_cast<const TypeFunction*>(type);
+        each(func->to);
+        each(func->from);
+    } else if (type->kind == TypeKind::Compound) {
+        auto& args = static_cast<const TypeCompound*>(type)->args;
+        for (size_t i = args.size(); i-- > 0;) {
+            each(args[i]);
+        }
+    }
+}
+
+// Hash-consing factory
+// Builds every type through one table per kind, so structurally identical
+// types are a single shared node and comparing them is a pointer check.
+// Variables are interned by name too: the same name is the same variable.
+// Nodes live as long as the factory, or until it is cleared. Each call takes
+// the factory's lock, so separate threads may build types at once; building
+// is all it guards. types() is the process-wide factory; a client that
+// builds types for a while and then drops them, like the interpreter's
+// type checker, keeps a factory of its own.
+class TypeFactory {
+public:
+    std::shared_ptr<Type> constant(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& node = constants[name];
+        if (!node) {
+            node = std::make_shared<TypeConstant>(name);
+        }
+        return node;
+    }
+
+    std::shared_ptr<Type> variable(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return variableLocked(name);
+    }
+
+    // A variable whose name has not been used yet. Neither it nor its name
+    // is interned, so it is freed once nothing holds it, and variable()
+    // never returns it.
+    std::shared_ptr<Type> fresh() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string name;
+        do {
+            name = "t" + std::to_string(nextFresh++);
+        } while (variables.count(name));
+        return std::make_shared<TypeVariable>(name, uninternedId);
+    }
+
+    std::shared_ptr<Type> function(const std::shared_ptr<Type>& from, const std::shared_ptr<Type>& to) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& node = functions[{from.get(), to.get()}];
+        if (!node) {
+            node = std::make_shared<TypeFunction>(from, to);
+        }
+        return node;
+    }
+
+    std::shared_ptr<Type> compound(const std::string& name, std::vector<std::shared_ptr<Type>> args) {
+        CompoundKey key{typeNames().intern(name), {}};
+        key.args.reserve(args.size());
+        for (const auto& arg : args) {
+            key.args.push_back(arg.get());
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& node = compounds[key];
+        if (!node) {
+            node = std::make_shared<TypeCompound>(name, key.functor, std::move(args));
+        }
+        return node;
+    }
+
+    // Forgets every node, freeing those nothing else holds. The rest stay
+    // valid but are no longer shared with nodes built from now on. Fresh
+    // names keep counting up, so they are never reused.
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        constants.clear();
+        variables.clear();
+        functions.clear();
+        compounds.clear();
+    }
+
+private:
+    static constexpr uint32_t uninternedId = UINT32_MAX; // the id of every fresh variable
+
+    std::shared_ptr<Type> variableLocked(const std::string& name) {
+        auto& node = variables[name];
+        if (!node) {
+            node = std::make_shared<TypeVariable>(name);
+        }
+        return node;
+    }
+
+    static size_t combine(size_t h, size_t value) {
+        return h ^ (value + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2));
+    }
+
+    struct PairHash {
+        size_t operator()(const std::pair<const Type*, const Type*>& key) const {
+            return combine(std::hash<const Type*>()(key.first), std::hash<const Type*>()(key.second));
+        }
+    };
+
+    struct CompoundKey {
+        uint32_t functor;
+        std::vector<const Type*> args;
+
+        bool operator==(const CompoundKey& other) const { return functor == other.functor && args == other.args; }
+    };
+
+    struct CompoundHash {
+        size_t operator()(const CompoundKey& key) const {
+            size_t h = key.functor;
+            for (const Type* arg : key.args) {
+                h = combine(h, std::hash<const Type*>()(arg));
+            }
+            return h;
+        }
+    };
+
+    std::unordered_map<std::string, std::shared_ptr<TypeConstant>> constants;
+    std::unordered_map<std::string, std::shared_ptr<TypeVariable>> variables;
+    std::unordered_map<std::pair<const Type*, const Type*>, std::shared_ptr<TypeFunction>, PairHash> functions;
+    std::unordered_map<CompoundKey, std::shared_ptr<TypeCompound>, CompoundHash> compounds;
+    size_t nextFresh = 0;
+    std::mutex mutex;
+};
+
+inline TypeFactory& types() {
+    static TypeFactory factory;
+    return factory;
+}
+
+inline std::string Type::toString() const {
+    // Work items are a type to print, literal text, or the end of a
+    // variable's binding
+    struct Item {
+        const Type* type;
+        const char* text;
+        const TypeVariable* leave;
+    };
+    std::string out;
+    std::vector<Item> work{{this, nullptr, nullptr}};
+    while (!work.empty()) {
+        Item item = work.back();
+        work.pop_back();
+        if (item.text) {
+            out += item.text;
+        } else if (item.leave) {
+            item.leave->onPath = false;
+        } else if (item.type->kind == TypeKind::Variable) {
+            auto var = static_cast<const TypeVariable*>(item.type);
+            if (!var->binding || var->onPath) {
+                // A binding left cyclic by a deferred occurs check prints by name
+                out += var->name;
+            } else {
+                var->onPath = true;
+                work.push_back({nullptr, nullptr, var});
+                work.push_back({var->binding.get(), nullptr, nullptr});
+            }
+        } else if (item.type->kind == TypeKind::Constant) {
+            out += static_cast<const TypeConstant*>(item.type)->name;
+        } else if (item.type->kind == TypeKind::Compound) {
+            // name(arg, ...)
+            auto term = static_cast<const TypeCompound*>(item.type);
+            out += term->name;
+            out += "(";
+            work.push_back({nullptr, ")", nullptr});
+            for (size_t i = term->args.size(); i-- > 0;) {
+                work.push_back({term->args[i].get(), nullptr, nullptr});
+                if (i > 0) {
+                    work.push_back({nullptr, ", ", nullptr});
+                }
+            }
+        } else {
+            auto func = static_cast<const TypeFunction*>(item.type);
+            out += "(";
+            work.push_back({nullptr, ")", nullptr});
+            work.push_back({func->to.get(), nullptr, nullptr});
+            work.push_back({nullptr, " -> ", nullptr});
+            work.push_back({func->from.get(), nullptr, nullptr});
+        }
+    }
+    return out;
+}
+
+inline std::shared_ptr<Type> Type::apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) const {
+    return apply(subst, types());
+}
+
+// Post-order over the DAG: an arrow or compound is rebuilt, through the
+// factory, only once its subterms are done and only if one of them
+// changed. Results are memoized per node so shared subterms are rewritten
+// once.
+inline std::shared_ptr<Type> Type::apply(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst,
+                                         TypeFactory& factory) const {
+    std::unordered_map<const Type*, std::shared_ptr<Type>> done;
+    std::vector<const Type*> work{this};
+    while (!work.empty()) {
+        const Type* type = work.back();
+        if (done.count(type)) {
+            work.pop_back();
+            continue;
+        }
+        if (type->kind == TypeKind::Variable) {
+            auto var = static_cast<const TypeVariable*>(type);
+            const Type* target = var->binding.get();
+            if (!target) {
+                auto it = subst.find(var->name);
+                target = it != subst.end() ? it->second.get() : nullptr;
+            }
+            if (!target) {
+                done[type] = type->self();
+            } else if (done.count(target)) {
+                done[type] = done[target];
+            } else {
+                work.push_back(target);
+                continue;
+            }
+        } else if (type->kind == TypeKind::Function) {
+            auto func = static_cast<const TypeFunction*>(type);
+            auto from = done.find(func->from.get());
+            auto to = done.find(func->to.get());
+            if (from == done.end() || to == done.end()) {
+                if (to == done.end()) {
+                    work.push_back(func->to.get());
+                }
+                if (from == done.end()) {
+                    work.push_back(func->from.get());
+                }
+                continue;
+            }
+            if (from->second == func->from && to->second == func->to) {
+                done[type] = type->self();
+            } else {
+                done[type] = factory.function(from->second, to->second);
+            }
+        } else if (type->kind == TypeKind::Compound) {
+            auto term = static_cast<const TypeCompound*>(type);
+            bool ready = true;
+            for (size_t i = term->args.size(); i-- > 0;) {
+                if (!done.count(term->args[i].get())) {
+                    work.push_back(term->args[i].get());
+                    ready = false;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            bool changed = false;
+            std::vector<std::shared_ptr<Type>> args;
+            args.reserve(term->args.size());
+            for (const auto& arg : term->args) {
+                args.push_back(done[arg.get()]);
+                changed |= args.back() != arg;
+            }
+            done[type] = changed ? factory.compound(term->name, std::move(args)) : type->self();
+        } else {
+            done[type] = type->self();
+        }
+        work.pop_back();
+    }
+    return done[this];
+}
+
+inline void Type::collectFreeTypeVars(std::unordered_set<std::string>& vars) const {
+    uint32_t stamp = nextVisit();
+    std::vector<const Type*> work{this};
+    while (!work.empty()) {
+        const Type* type = work.back();
+        work.pop_back();
+        if (type->seen(stamp)) {
+            continue;
+        }
+        type->mark(stamp);
+        if (type->kind == TypeKind::Variable) {
+            auto var = static_cast<const TypeVariable*>(type);
+            if (var->binding) {
+                work.push_back(var->binding.get());
+            } else {
+                vars.insert(var->name);
+            }
+        } else {
+            forEachChildReversed(type, [&](const Type* child) { work.push_back(child); });
+        }
+    }
+}
+
+// The scratch stack is kept between calls, so a check allocates nothing
+// once it has grown to the deepest type seen
+inline bool occursIn(const TypeVariable* var, const Type* type, uint32_t stamp) {
+    static thread_local std::vector<const Type*> work;
+    work.clear();
+    work.push_back(type);
+    while (!work.empty()) {
+        type = work.back();
+        work.pop_back();
+        if (type->ground || type->seen(stamp)) {
+            continue;
+        }
+        type->mark(stamp);
+        if (type->kind == TypeKind::Variable) {
+            auto other = static_cast<const TypeVariable*>(type);
+            if (other == var) {
+                return true;
+            }
+            if (other->binding) {
+                work.push_back(other->binding.get());
+            }
+        } else {
+            forEachChildReversed(type, [](const Type* child) { work.push_back(child); });
+        }
+    }
+    return false;
+}
+
+// Occurs check to prevent infinite types: follows bindings, stops at the
+// first hit, visits shared subterms once, skips ground ones without
+// walking them and allocates nothing
+inline bool occursInType(const TypeVariable& var, const Type& type) {
+    LISP_STAT(UnifyOccursChecks);
+    return occursIn(&var, &type, nextVisit());
+}
+
+// Eager checks every binding as it is made. Deferred skips the check so a
+// batch of unifications can be verified once with checkCycles; until then
+// bindings may be cyclic and must not be passed to apply.
+enum class OccursCheck {
+    Eager,
+    Deferred,
+};
+
+// Finds a variable bound, directly or through other bindings, to a type
+// containing itself. Any cycle passes through a binding, so variables on
+// the current path are tracked and other nodes are marked done on the way
+// out.
+inline bool hasCycle(const Type* start, uint32_t stamp) {
+    struct Item {
+        const Type* type;
+        bool leave;
+    };
+    std::vector<Item> work{{start, false}};
+    bool cyclic = false;
+    while (!work.empty()) {
+        Item item = work.back();
+        work.pop_back();
+        const Type* type = item.type;
+        if (item.leave) {
+            if (type->kind == TypeKind::Variable) {
+                static_cast<const TypeVariable*>(type)->onPath = false;
+            }
+            type->mark(stamp);
+            continue;
+        }
+        if (cyclic || type->seen(stamp)) {
+            continue;
+        }
+        if (type->kind == TypeKind::Variable) {
+            auto var = static_cast<const TypeVariable*>(type);
+            if (!var->binding) {
+                continue;
+            }
+            if (var->onPath) {
+                // Keep unwinding so every onPath flag is cleared
+                cyclic = true;
+                continue;
+            }
+            var->onPath = true;
+            work.push_back({type, true});
+            work.push_back({var->binding.get(), false});
+        } else if (type->kind != TypeKind::Constant) {
+            work.push_back({type, true});
+            forEachChildReversed(type, [&](const Type* child) { work.push_back({child, false}); });
+        }
+    }
+    return cyclic;
+}
+
+// Follows variable bindings to the representative of a type's class,
+// pointing every variable on the way directly at it (path compression)
+// unless `compress` is false
+inline std::shared_ptr<Type> find(std::shared_ptr<Type> type, bool compress = true) {
+    std::shared_ptr<Type> root = type;
+    while (root->kind == TypeKind::Variable) {
+        const auto& binding = static_cast<TypeVariable&>(*root).binding;
+        if (!binding) {
+            break;
+        }
+        root = binding;
+    }
+    while (compress && type != root) {
+        auto& binding = static_cast<TypeVariable&>(*type).binding;
+        auto next = std::move(binding);
+        binding = root;
+        type = std::move(next);
+    }
+    return root;
+}
+
+// Trail
+// An undo log of every write unification makes to a variable cell, so a
+// caller can snapshot the bindings with mark() and roll back to it with
+// undoTo() in time proportional to the writes since. This is what
+// backtracking search needs instead of copying a substitution.
+//
+// Unification under a trail does not compress paths, which would only add
+// entries; union by rank alone keeps binding chains logarithmic.
+class Trail {
+public:
+    using Mark = size_t;
+
+    Mark mark() const { return entries.size(); }
+
+    // Restores every cell written since `mark`, most recent first
+    void undoTo(Mark mark) {
+        while (entries.size() > mark) {
+            Entry& entry = entries.back();
+            entry.var->binding = std::move(entry.binding);
+            entry.var->rank = entry.rank;
+            entries.pop_back();
+        }
+    }
+
+    // Saves a variable's cell before it is written
+    void record(const std::shared_ptr<TypeVariable>& var) {
+        entries.push_back({var, var->binding, var->rank});
+    }
+
+    // Keeps every binding made so far and forgets how to undo them, once
+    // nothing can backtrack past them
+    void clear() { entries.clear(); }
+
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry {
+        std::shared_ptr<TypeVariable> var;
+        std::shared_ptr<Type> binding;
+        unsigned rank;
+    };
+    std::vector<Entry> entries;
+};
+
+struct UnifyState {
+    OccursCheck check;
+    std::vector<std::shared_ptr<TypeVariable>> bound; // every variable bound, in order
+
+    // With the check deferred, types may be cyclic; pairs of arrows and
+    // compounds already being unified are remembered so unification still
+    // terminates
+    struct PairHash {
+        size_t operator()(const std::pair<const Type*, const Type*>& key) const {
+            return std::hash<const Type*>()(key.first) * 31 + std::hash<const Type*>()(key.second);
+        }
+    };
+    std::unordered_set<std::pair<const Type*, const Type*>, PairHash> terms;
+
+    // Equations still to solve
+    std::vector<std::pair<std::shared_ptr<Type>, std::shared_ptr<Type>>> work;
+
+    std::string error; // why the last unifyCells call failed
+
+    Trail* trail = nullptr; // records every binding, if set
+};
+
+// Solves one equation between two distinct representatives; the sides of
+// two arrows, or the arguments of two compounds, are queued as new
+// equations. Failures are reported through
+// state.error rather than thrown, so a batch with many of them stays cheap.
+inline bool unifyStep(const std::shared_ptr<Type>& t1, const std::shared_ptr<Type>& t2, UnifyState& state) {
+    LISP_STAT(UnifySteps);
+    if (t1->kind == TypeKind::Variable && t2->kind == TypeKind::Variable) {
+        auto var1 = std::static_pointer_cast<TypeVariable>(t1);
+        auto var2 = std::static_pointer_cast<TypeVariable>(t2);
+        // Link the lower-ranked class under the other one
+        if (var1->rank > var2->rank) {
+            std::swap(var1, var2);
+        } else if (var1->rank == var2->rank) {
+            if (state.trail) {
+                state.trail->record(var2);
+            }
+            ++var2->rank;
+        }
+        if (state.trail) {
+            state.trail->record(var1);
+        }
+        var1->binding = var2;
+        state.bound.push_back(var1);
+        LISP_STAT(UnifyBindings);
+    }
+    else if (t1->kind == TypeKind::Variable || t2->kind == TypeKind::Variable) {
+        bool first = t1->kind == TypeKind::Variable;
+        auto var = std::static_pointer_cast<TypeVariable>(first ? t1 : t2);
+        auto type = first ? t2 : t1;
+        if (state.check == OccursCheck::Eager && occursInType(*var, *type)) {
+            state.error = "Occurs check failed: " + var->name + " occurs in " + type->toString();
+            return false;
+        }
+        if (state.trail) {
+            state.trail->record(var);
+        }
+        var->binding = type;
+        state.bound.push_back(var);
+        LISP_STAT(UnifyBindings);
+    }
+    else if (t1->kind != t2->kind) {
+        state.error = "Type mismatch: " + t1->toString() + " vs " + t2->toString();
+        return false;
+    }
+    else if (t1->kind != TypeKind::Constant && state.check == OccursCheck::Deferred &&
+             !state.terms.insert({t1.get(), t2.get()}).second) {
+        // Already being unified further up a cyclic type
+    }
+    else if (t1->kind == TypeKind::Function) {
+        auto& func1 = static_cast<TypeFunction&>(*t1);
+        auto& func2 = static_cast<TypeFunction&>(*t2);
+        state.work.emplace_back(func1.to, func2.to);
+        state.work.emplace_back(func1.from, func2.from);
+    }
+    else if (t1->kind == TypeKind::Compound) {
+        auto& term1 = static_cast<TypeCompound&>(*t1);
+        auto& term2 = static_cast<TypeCompound&>(*t2);
+        if (term1.functor != term2.functor || term1.args.size() != term2.args.size()) {
+            state.error = "Type mismatch: " + t1->toString() + " vs " + t2->toString();
+            return false;
+        }
+        for (size_t i = term1.args.size(); i-- > 0;) {
+            state.work.emplace_back(term1.args[i], term2.args[i]);
+        }
+    }
+    else if (static_cast<TypeConstant&>(*t1).id == static_cast<TypeConstant&>(*t2).id) {
+        // Type constants are equal
+    }
+    else {
+        state.error = "Type mismatch: " + t1->toString() + " vs " + t2->toString();
+        return false;
+    }
+    return true;
+}
+
+// Unifies two types by binding variables in place, solving the equations
+// their subterms give rise to from an explicit worklist
+inline bool unifyCells(std::shared_ptr<Type> left, std::shared_ptr<Type> right, UnifyState& state) {
+    LISP_STAT(UnifyCalls);
+    state.work.clear();
+    state.work.emplace_back(std::move(left), std::move(right));
+    while (!state.work.empty()) {
+        auto t1 = find(std::move(state.work.back().first), !state.trail);
+        auto t2 = find(std::move(state.work.back().second), !state.trail);
+        state.work.pop_back();
+        if (t1 != t2 && !unifyStep(t1, t2, state)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The unification algorithm
+// Bindings live in the variables themselves, so successive calls share
+// them. `subst` is an export view: each variable bound by this call is
+// mapped to the representative of its class. With a trail, every binding
+// made, including those of a call that fails, can be undone.
+inline void unify(std::shared_ptr<Type> t1, std::shared_ptr<Type> t2,
+                  std::unordered_map<std::string, std::shared_ptr<Type>>& subst,
+                  OccursCheck check = OccursCheck::Eager, Trail* trail = nullptr) {
+    UnifyState state{check, {}, {}, {}, {}, trail};
+    bool unified = unifyCells(t1, t2, state);
+    for (auto& var : state.bound) {
+        subst[var->name] = find(var, !trail);
+    }
+    if (!unified) {
+        throw std::runtime_error(state.error);
+    }
+}
+
+// The single check that completes a batch of deferred unifications:
+// throws if any exported binding is cyclic
+inline void checkCycles(const std::unordered_map<std::string, std::shared_ptr<Type>>& subst) {
+    uint32_t stamp = nextVisit();
+    for (const auto& pair : subst) {
+        if (hasCycle(pair.second.get(), stamp)) {
+            throw std::runtime_error("Occurs check failed: the binding of " + pair.first + " is an infinite type");
+        }
+    }
+}
+
+// Batch solving
+// Solves a whole set of equality constraints in one pass over shared
+// state, and reports every constraint that fails instead of stopping at
+// the first. Bindings made by a failing constraint before it failed are
+// kept, as with unify.
+struct Constraint {
+    std::shared_ptr<Type> left;
+    std::shared_ptr<Type> right;
+};
+
+struct UnifyError {
+    size_t index; // of the constraint that failed
+    std::string message;
+};
+
+struct SolveResult {
+    std::unordered_map<std::string, std::shared_ptr<Type>> subst;
+    std::vector<UnifyError> errors;
+
+    bool ok() const { return errors.empty(); }
+};
+
+// Solves the constraints listed in group, in that order, over one state
+inline void solveGroup(const std::vector<Constraint>& constraints, const std::vector<size_t>& group, OccursCheck check,
+                       SolveResult& result) {
+    UnifyState state{check, {}, {}, {}, {}};
+    std::vector<size_t> boundBy; // constraint index for each entry of state.bound
+    for (size_t i : group) {
+        if (!unifyCells(constraints[i].left, constraints[i].right, state)) {
+            result.errors.push_back({i, std::move(state.error)});
+        }
+        boundBy.resize(state.bound.size(), i);
+    }
+
+    if (check == OccursCheck::Deferred) {
+        // Blame a cycle on the constraint that bound the variable it was found from
+        uint32_t stamp = nextVisit();
+        for (size_t i = 0; i < state.bound.size(); ++i) {
+            if (hasCycle(state.bound[i].get(), stamp)) {
+                result.errors.push_back({boundBy[i], "Occurs check failed: the binding of " + state.bound[i]->name +
+                                                         " is an infinite type"});
+                break;
+            }
+        }
+    }
+
+    result.subst.reserve(result.subst.size() + state.bound.size());
+    for (auto& var : state.bound) {
+        result.subst[var->name] = find(var);
+    }
+}
+
+inline SolveResult solve(const std::vector<Constraint>& constraints, OccursCheck check = OccursCheck::Eager) {
+    SolveResult result;
+    std::vector<size_t> all(constraints.size());
+    std::iota(all.begin(), all.end(), 0);
+    solveGroup(constraints, all, check, result);
+    return result;
+}
+
+// Splits constraints into groups that reach no common variable, following
+// bindings. Solving a group only writes the cells of variables it reaches,
+// so groups can be solved independently. Groups come in order of their
+// first constraint and keep input order within.
+inline std::vector<std::vector<size_t>> independentGroups(const std::vector<Constraint>& constraints) {
+    std::vector<size_t> parent(constraints.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto root = [&](size_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+
+    std::unordered_map<const Type*, size_t> owner; // variable -> a constraint reaching it
+    std::vector<const Type*> work;
+    for (size_t i = 0; i < constraints.size(); ++i) {
+        uint32_t stamp = nextVisit();
+        work.assign({constraints[i].left.get(), constraints[i].right.get()});
+        while (!work.empty()) {
+            const Type* type = work.back();
+            work.pop_back();
+            if (type->seen(stamp)) {
+                continue;
+            }
+            type->mark(stamp);
+            if (type->kind == TypeKind::Variable) {
+                auto added = owner.emplace(type, i);
+                if (!added.second) {
+                    parent[root(added.first->second)] = root(i);
+                }
+                if (auto& binding = static_cast<const TypeVariable*>(type)->binding) {
+                    work.push_back(binding.get());
+                }
+            } else {
+                forEachChildReversed(type, [&](const Type* child) { work.push_back(child); });
+            }
+        }
+    }
+
+    std::vector<std::vector<size_t>> groups;
+    std::unordered_map<size_t, size_t> groupOf; // root -> position in groups
+    for (size_t i = 0; i < constraints.size(); ++i) {
+        auto slot = groupOf.emplace(root(i), groups.size());
+        if (slot.second) {
+            groups.emplace_back();
+        }
+        groups[slot.first->second].push_back(i);
+    }
+    return groups;
+}
+
+// Same result as solve, with independent groups of constraints solved
+// concurrently on the pool. Workers only bind and compare existing nodes;
+// nothing is built through the factory or the name table off this thread.
+// Under a deferred check each group reports its own first cycle.
+inline SolveResult solveParallel(const std::vector<Constraint>& constraints, ThreadPool& pool,
+                                 OccursCheck check = OccursCheck::Eager) {
+    auto groups = independentGroups(constraints);
+    if (groups.size() < 2) {
+        return solve(constraints, check);
+    }
+
+    std::vector<SolveResult> partial(groups.size());
+    pool.parallelFor(groups.size(), [&](size_t g) {
+        solveGroup(constraints, groups[g], check, partial[g]);
+    });
+
+    SolveResult result;
+    for (auto& part : partial) {
+        result.subst.insert(std::make_move_iterator(part.subst.begin()), std::make_move_iterator(part.subst.end()));
+        result.errors.insert(result.errors.end(), std::make_move_iterator(part.errors.begin()),
+                             std::make_move_iterator(part.errors.end()));
+    }
+    std::stable_sort(result.errors.begin(), result.errors.end(),
+                     [](const UnifyError& a, const UnifyError& b) { return a.index < b.index; });
+    return result;
+}
+
+#endif